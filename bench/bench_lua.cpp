@@ -0,0 +1,75 @@
+#include <benchmark/benchmark.h>
+#include "workload.hpp"
+#include "lua.hpp"
+
+using namespace qmex;
+
+namespace
+{
+    const char script[] =
+        "T = qmex.Table()\n"
+        "T:parse(text)\n"
+        "function query(n)\n"
+        "    local t, qs, m = T, queries, #queries\n"
+        "    for i = 1, n do t:query(qs[i % m + 1], qmex.QUERY_SUBSET) end\n"
+        "end\n"
+        "function retrieve(n)\n"
+        "    local t, rows, data = T, T:rows() - 1, {}\n"
+        "    for i = 1, n do data.V1 = 0; t:retrieve(i % rows + 1, data) end\n"
+        "end\n";
+
+    /// Lua state with a parsed table T and the queries of spec.
+    lua_State* Open(const workload::Spec& spec)
+    {
+        lua_State* L = luaL_newstate();
+        luaL_openlibs(L);
+        luaL_requiref(L, "qmex", luaopen_qmex, 1);
+        lua_pop(L, 1);
+
+        lua_pushstring(L, workload::Table(spec).c_str());
+        lua_setglobal(L, "text");
+
+        const workload::Queries q(spec, 1024, workload::CRITERIA_ALL);
+        lua_createtable(L, (int)q.kvs.size(), 0);
+        for (std::size_t k = 0; k < q.kvs.size(); ++k)
+        {
+            lua_createtable(L, 0, (int)q.kvs[k].size());
+            for (std::size_t i = 0; i < q.kvs[k].size(); ++i)
+            {
+                const KeyValue& kv = q.kvs[k][i];
+                if (kv.type == NUMBER) lua_pushnumber(L, (double)kv.val.n);
+                else lua_pushstring(L, kv.val.s);
+                lua_setfield(L, -2, kv.key);
+            }
+            lua_rawseti(L, -2, (lua_Integer)k + 1);
+        }
+        lua_setglobal(L, "queries");
+
+        if (luaL_dostring(L, script)) throw LuaError(lua_tostring(L, -1));
+        return L;
+    }
+}
+
+/// Table:query and Table:retrieve of plain cells called from lua, compare with Query and Retrieve for the binding overhead.
+static void LuaBinding(benchmark::State& state)
+{
+    const char* const functions[] = { "query", "retrieve" };
+    workload::Spec spec;
+    spec.rows = 1000;
+    lua_State* L = Open(spec);
+    const int n = 256;
+    for (auto _ : state)
+    {
+        lua_getglobal(L, functions[state.range(0)]);
+        lua_pushinteger(L, n);
+        if (lua_pcall(L, 1, 0, 0))
+        {
+            state.SkipWithError(lua_tostring(L, -1));
+            break;
+        }
+    }
+    lua_close(L);
+    state.SetItemsProcessed((int64_t)state.iterations() * n);
+    state.SetLabel(functions[state.range(0)]);
+}
+BENCHMARK(LuaBinding)->DenseRange(0, 1);
@@ -0,0 +1,45 @@
+#include <benchmark/benchmark.h>
+#include <qmex.hpp>
+
+#include <string>
+
+using namespace qmex;
+
+static void NumberParse(benchmark::State& state)
+{
+    const char* const texts[] = { "0", "85.5", "-1234.567", "12.50", "inf", "-0.05" };
+    std::size_t k = 0;
+    for (auto _ : state)
+    {
+        Number n(texts[k++ % 6]);
+        benchmark::DoNotOptimize(n.n);
+    }
+    state.SetItemsProcessed((int64_t)state.iterations());
+}
+BENCHMARK(NumberParse);
+
+static void NumberFormat(benchmark::State& state)
+{
+    const Number numbers[] = { Number(0.0), Number(85.5), Number(-1234.567), Number::inf() };
+    char buf[32];
+    std::size_t k = 0;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(numbers[k++ % 4].toString(buf, sizeof(buf)));
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed((int64_t)state.iterations());
+}
+BENCHMARK(NumberFormat);
+
+static void NumberFormatString(benchmark::State& state)
+{
+    const Number n(-1234.567);
+    for (auto _ : state)
+    {
+        std::string s = n;
+        benchmark::DoNotOptimize(s.data());
+    }
+    state.SetItemsProcessed((int64_t)state.iterations());
+}
+BENCHMARK(NumberFormatString);
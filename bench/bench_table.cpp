@@ -0,0 +1,130 @@
+#include <benchmark/benchmark.h>
+#include "workload.hpp"
+
+#include <cstring>
+#include <vector>
+
+using namespace qmex;
+
+namespace
+{
+    workload::Spec Rows(int rows)
+    {
+        workload::Spec spec;
+        spec.rows = rows;
+        return spec;
+    }
+
+    /// Table parsed from a buffer owned by itself.
+    struct Parsed : Table
+    {
+        std::vector<char> buf;
+
+        explicit Parsed(const workload::Spec& spec)
+        {
+            const std::string text = workload::Table(spec);
+            buf.assign(text.c_str(), text.c_str() + text.size() + 1);
+            parse(&buf[0], buf.size());
+        }
+    };
+
+    const char* MixName(unsigned mix)
+    {
+        switch (mix)
+        {
+        case workload::CRITERIA_EQ: return "EQ";
+        case workload::CRITERIA_MH: return "MH";
+        case workload::CRITERIA_RANGE: return "GE+LT";
+        case workload::CRITERIA_AE: return "AE";
+        default: return "all";
+        }
+    }
+
+    void Sizes(benchmark::internal::Benchmark* b)
+    {
+        const unsigned mixes[] = { workload::CRITERIA_EQ, workload::CRITERIA_MH, workload::CRITERIA_RANGE,
+                                   workload::CRITERIA_AE, workload::CRITERIA_ALL };
+        for (int rows = 100; rows <= 100000; rows *= 10)
+            for (std::size_t m = 0; m < sizeof(mixes) / sizeof(mixes[0]); ++m)
+                b->Args({ rows, (int)mixes[m] });
+    }
+}
+
+/// Table::parse throughput by rows and tokenizer threads, 0 for hardware concurrency.
+static void Parse(benchmark::State& state)
+{
+    const std::string text = workload::Table(Rows((int)state.range(0)));
+    std::vector<char> buf(text.size() + 1);
+    Table t;
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        std::memcpy(&buf[0], text.c_str(), buf.size());
+        state.ResumeTiming();
+        t.parse(&buf[0], buf.size(), ParseOptions((unsigned)state.range(1)));
+        benchmark::DoNotOptimize(t.rows());
+    }
+    state.SetBytesProcessed((int64_t)state.iterations() * (int64_t)text.size());
+}
+BENCHMARK(Parse)->Args({ 1000, 1 })->Args({ 100000, 1 })->Args({ 100000, 0 })->Unit(benchmark::kMillisecond);
+
+/// Table::query by rows and criteria mix.
+static void Query(benchmark::State& state)
+{
+    const workload::Spec spec = Rows((int)state.range(0));
+    const Parsed t(spec);
+    const workload::Queries q(spec, 1024, (unsigned)state.range(1));
+    std::size_t k = 0;
+    for (auto _ : state)
+    {
+        const std::vector<KeyValue>& kvs = q.kvs[k++ % q.kvs.size()];
+        benchmark::DoNotOptimize(t.query(&kvs[0], kvs.size(), QUERY_SUBSET));
+    }
+    state.SetItemsProcessed((int64_t)state.iterations());
+    state.SetLabel(MixName((unsigned)state.range(1)));
+}
+BENCHMARK(Query)->Apply(Sizes);
+
+/// Table::queryBatch of 256 queries by rows and criteria mix.
+static void QueryBatch(benchmark::State& state)
+{
+    const workload::Spec spec = Rows((int)state.range(0));
+    const Parsed t(spec);
+    const workload::Queries q(spec, 256, (unsigned)state.range(1));
+    std::vector<const KeyValue*> queries;
+    std::vector<std::size_t> nums;
+    for (std::size_t k = 0; k < q.kvs.size(); ++k)
+    {
+        queries.push_back(&q.kvs[k][0]);
+        nums.push_back(q.kvs[k].size());
+    }
+    std::vector<int> rows(queries.size());
+    for (auto _ : state)
+    {
+        t.queryBatch(&queries[0], &nums[0], queries.size(), &rows[0], QUERY_SUBSET);
+        benchmark::DoNotOptimize(&rows[0]);
+    }
+    state.SetItemsProcessed((int64_t)state.iterations() * (int64_t)queries.size());
+    state.SetLabel(MixName((unsigned)state.range(1)));
+}
+BENCHMARK(QueryBatch)->Apply(Sizes);
+
+/// Table::retrieve of a plain, {} or [] cell.
+static void Retrieve(benchmark::State& state)
+{
+    const char* const kinds[] = { "plain", "{}", "[]" };
+    workload::Spec spec = Rows(1000);
+    spec.lua = state.range(0) == 1 ? 1 : 0;
+    spec.calls = state.range(0) == 2 ? 1 : 0;
+    Parsed t(spec);
+    int row = 0;
+    for (auto _ : state)
+    {
+        KeyValue kv("V1", 0.0);
+        t.retrieve(row++ % spec.rows + 1, &kv, 1);
+        benchmark::DoNotOptimize(kv.val.n.n);
+    }
+    state.SetItemsProcessed((int64_t)state.iterations());
+    state.SetLabel(kinds[state.range(0)]);
+}
+BENCHMARK(Retrieve)->DenseRange(0, 2);
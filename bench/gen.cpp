@@ -0,0 +1,157 @@
+//
+// Copyright (c) 2018-2025 Huang Qinjin (huangqinjin@gmail.com)
+//
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          https://www.boost.org/LICENSE_1_0.txt)
+//
+#include "workload.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+using namespace std;
+using namespace qmex;
+
+namespace
+{
+    struct Preset
+    {
+        const char* name;
+        int rows, eq, mh, ranges, ae, values;
+        double lua, calls;
+    };
+
+    const Preset presets[] = {
+        { "small",    1000, 1, 1, 1, 0,  2, 0,   0    },
+        { "large", 1000000, 2, 1, 1, 1,  4, 0,   0    },
+        { "wide",   100000, 8, 4, 4, 4, 16, 0,   0    },
+        { "lua",    100000, 1, 1, 1, 0,  4, 0.3, 0.05 },
+    };
+
+    int usage(const char* argv0)
+    {
+        printf("Usage: %s [options] </path/to/table> [</path/to/queries>]\n", argv0);
+        printf("  --preset <name>       small, large, wide or lua, changed by the options after it\n");
+        printf("  --rows <n>            body rows\n");
+        printf("  --eq <n>              EQ columns\n");
+        printf("  --mh <n>              MH columns\n");
+        printf("  --ranges <n>          GE/LT column pairs\n");
+        printf("  --ae <n>              AE columns\n");
+        printf("  --values <n>          data columns\n");
+        printf("  --cardinality <n>     distinct values of an EQ column\n");
+        printf("  --words <n>           distinct words of MH patterns\n");
+        printf("  --bands <n>           distinct intervals of a range\n");
+        printf("  --overlap <n>         extra width of an interval into the next one, intervals start every %d\n", (int)workload::BAND);
+        printf("  --lua <fraction>      data cells that are {} expressions\n");
+        printf("  --calls <fraction>    data cells that are [] function calls\n");
+        printf("  --seed <n>            the same seed always generates the same workload\n");
+        printf("  --queries <n>         query lines for qmex-cli, 1000 by default\n");
+        printf("  --mix <kinds>         criteria of the queries, any of eq,mh,range,ae joined by ',', all by default\n");
+        return 65534;
+    }
+
+    unsigned mix(const char* s)
+    {
+        unsigned m = 0;
+        if (strstr(s, "eq")) m |= workload::CRITERIA_EQ;
+        if (strstr(s, "mh")) m |= workload::CRITERIA_MH;
+        if (strstr(s, "range")) m |= workload::CRITERIA_RANGE;
+        if (strstr(s, "ae")) m |= workload::CRITERIA_AE;
+        return m;
+    }
+
+    void write(const char* path, const string& s)
+    {
+        FILE* f = fopen(path, "wb");
+        if (f == nullptr || fwrite(s.data(), 1, s.size(), f) != s.size() || fclose(f) != 0)
+            throw runtime_error("Failed to write file [" + string(path) + ']');
+    }
+}
+
+int main(int argc, char* argv[]) try
+{
+    workload::Spec spec;
+    int queries = 1000;
+    unsigned criteria = workload::CRITERIA_ALL;
+    const char* paths[2] = { nullptr, nullptr };
+    int npaths = 0;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        if (strncmp(arg, "--", 2) != 0)
+        {
+            if (npaths == 2) return usage(argv[0]);
+            paths[npaths++] = arg;
+            continue;
+        }
+        if (i + 1 == argc) return usage(argv[0]);
+        const char* val = argv[++i];
+
+        if (strcmp(arg, "--preset") == 0)
+        {
+            const Preset* p = presets;
+            while (p != presets + sizeof(presets) / sizeof(presets[0]) && strcmp(p->name, val)) ++p;
+            if (p == presets + sizeof(presets) / sizeof(presets[0])) return usage(argv[0]);
+            spec.rows = p->rows;
+            spec.eq = p->eq;
+            spec.mh = p->mh;
+            spec.ranges = p->ranges;
+            spec.ae = p->ae;
+            spec.values = p->values;
+            spec.lua = p->lua;
+            spec.calls = p->calls;
+        }
+        else if (strcmp(arg, "--rows") == 0) spec.rows = atoi(val);
+        else if (strcmp(arg, "--eq") == 0) spec.eq = atoi(val);
+        else if (strcmp(arg, "--mh") == 0) spec.mh = atoi(val);
+        else if (strcmp(arg, "--ranges") == 0) spec.ranges = atoi(val);
+        else if (strcmp(arg, "--ae") == 0) spec.ae = atoi(val);
+        else if (strcmp(arg, "--values") == 0) spec.values = atoi(val);
+        else if (strcmp(arg, "--cardinality") == 0) spec.cardinality = atoi(val);
+        else if (strcmp(arg, "--words") == 0) spec.words = atoi(val);
+        else if (strcmp(arg, "--bands") == 0) spec.bands = atoi(val);
+        else if (strcmp(arg, "--overlap") == 0) spec.overlap = atoi(val);
+        else if (strcmp(arg, "--lua") == 0) spec.lua = atof(val);
+        else if (strcmp(arg, "--calls") == 0) spec.calls = atof(val);
+        else if (strcmp(arg, "--seed") == 0) spec.seed = (unsigned)strtoul(val, nullptr, 10);
+        else if (strcmp(arg, "--queries") == 0) queries = atoi(val);
+        else if (strcmp(arg, "--mix") == 0) criteria = mix(val);
+        else return usage(argv[0]);
+    }
+
+    if (npaths == 0 || spec.rows <= 0 || spec.eq < 0 || spec.mh < 0 || spec.ranges < 0 || spec.ae < 0 ||
+        spec.eq + spec.mh + spec.ranges + spec.ae == 0 || spec.values <= 0 || spec.cardinality <= 0 ||
+        spec.words <= 0 || spec.bands <= 0 || spec.overlap < 0 || queries < 0 || criteria == 0)
+        return usage(argv[0]);
+
+    write(paths[0], workload::Table(spec));
+    if (paths[1] == nullptr) return 0;
+
+    // Criteria1:Value1 Criteria2:Value2 ... Data1 Data2 ...
+    const workload::Queries q(spec, queries, criteria);
+    string lines;
+    for (size_t k = 0; k < q.kvs.size(); ++k)
+    {
+        for (size_t i = 0; i < q.kvs[k].size(); ++i)
+        {
+            const KeyValue& kv = q.kvs[k][i];
+            lines += kv.key;
+            lines += ':';
+            lines += kv.type == NUMBER ? (string)kv.val.n : string(kv.val.s);
+            lines += ' ';
+        }
+        for (int c = 0; c < spec.values; ++c)
+            lines += 'V' + to_string(c) + (c + 1 < spec.values ? ' ' : '\n');
+    }
+    write(paths[1], lines);
+    return 0;
+}
+catch (exception& e)
+{
+    printf("%s\n", e.what());
+    return 65535;
+}
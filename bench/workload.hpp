@@ -0,0 +1,170 @@
+#ifndef QMEX_BENCH_WORKLOAD_HPP
+#define QMEX_BENCH_WORKLOAD_HPP
+
+#include <qmex.hpp>
+#include <deque>
+#include <string>
+#include <vector>
+
+/// Synthetic tables and queries. Every cell is a hash of the seed, the row and the column,
+/// so a workload is reproduced on any platform from its spec alone.
+namespace workload
+{
+    enum Mix
+    {
+        CRITERIA_EQ = 1,
+        CRITERIA_MH = 2,
+        CRITERIA_RANGE = 4, // a GE and LT column pair
+        CRITERIA_AE = 8,
+        CRITERIA_ALL = 15,
+    };
+
+    struct Spec
+    {
+        int rows;        // body rows
+        int eq;          // EQ columns
+        int mh;          // MH columns
+        int ranges;      // GE/LT column pairs
+        int ae;          // AE columns
+        int values;      // data columns
+        int cardinality; // distinct values of an EQ column
+        int words;       // distinct words of MH patterns
+        int bands;       // distinct intervals of a range
+        int overlap;     // extra width of each interval into the next one
+        double lua;      // fraction of data cells that are {} expressions
+        double calls;    // fraction of data cells that are [] function calls
+        unsigned seed;
+
+        Spec() : rows(1000), eq(1), mh(1), ranges(1), ae(1), values(2), cardinality(16), words(256), bands(32),
+                 overlap(0), lua(0), calls(0), seed(20180501) {}
+    };
+
+    inline unsigned Hash(unsigned seed, unsigned i, unsigned j)
+    {
+        unsigned h = seed * 0x9E3779B9u ^ i * 0x85EBCA6Bu ^ j * 0xC2B2AE35u;
+        h ^= h >> 16;
+        h *= 0x7FEB352Du;
+        h ^= h >> 15;
+        h *= 0x846CA68Bu;
+        h ^= h >> 16;
+        return h;
+    }
+
+    /// Columns of each kind are numbered apart from the others, so the j passed to Hash is unique.
+    enum Column { EQ_COLUMN = 0, MH_COLUMN = 1000, BAND_COLUMN = 2000, AE_COLUMN = 3000, VALUE_COLUMN = 4000 };
+
+    inline int Band(const Spec& spec, int i, int c)
+    {
+        return (int)(Hash(spec.seed, i, BAND_COLUMN + c) % (unsigned)spec.bands);
+    }
+
+    /// Distance between the lower bounds of adjacent bands of a range.
+    enum { BAND = 100 };
+
+    /// MH cell of row i, column c: a literal word mostly, otherwise alternatives, a prefix or a wildcard.
+    inline std::string Pattern(const Spec& spec, int i, int c)
+    {
+        const unsigned h = Hash(spec.seed, i, MH_COLUMN + c);
+        const std::string w = 'w' + std::to_string(h % (unsigned)spec.words);
+        switch (h >> 24 & 15)
+        {
+        case 0: case 1: case 2:
+            return w + "|w" + std::to_string((h >> 8) % (unsigned)spec.words);
+        case 3: case 4:
+            return w + '*';
+        case 5:
+            return 'w' + std::string(1, '?') + w.substr(2);
+        default:
+            return w;
+        }
+    }
+
+    /// A word matching Pattern(spec, i, c).
+    inline std::string Word(const Spec& spec, int i, int c)
+    {
+        const unsigned h = Hash(spec.seed, i, MH_COLUMN + c);
+        const std::string w = 'w' + std::to_string(h % (unsigned)spec.words);
+        return (h >> 24 & 15) == 3 || (h >> 24 & 15) == 4 ? w + 'x' : w;
+    }
+
+    inline std::string Value(const Spec& spec, int i, int c)
+    {
+        const unsigned h = Hash(spec.seed, i, VALUE_COLUMN + c);
+        const double u = (h >> 8) / 16777216.0;
+        if (c > 0 && u < spec.lua) return "{V0*2+" + std::to_string(c) + '}';
+        if (c > 0 && u < spec.lua + spec.calls) return "[math.random]";
+        return c == 0 ? std::to_string(i) : std::to_string(h % 1000) + ".5";
+    }
+
+    /// Table text of spec, e.g. "E0.EQ M0.MH R0.GE R0.LT A0.AE = V0 V1".
+    inline std::string Table(const Spec& spec)
+    {
+        std::string s;
+        for (int c = 0; c < spec.eq; ++c) s += 'E' + std::to_string(c) + ".EQ ";
+        for (int c = 0; c < spec.mh; ++c) s += 'M' + std::to_string(c) + ".MH ";
+        for (int c = 0; c < spec.ranges; ++c) s += 'R' + std::to_string(c) + ".GE R" + std::to_string(c) + ".LT ";
+        for (int c = 0; c < spec.ae; ++c) s += 'A' + std::to_string(c) + ".AE ";
+        s += '=';
+        for (int c = 0; c < spec.values; ++c) s += " V" + std::to_string(c);
+        s += '\n';
+
+        for (int i = 1; i <= spec.rows; ++i)
+        {
+            for (int c = 0; c < spec.eq; ++c)
+                s += std::to_string(Hash(spec.seed, i, EQ_COLUMN + c) % (unsigned)spec.cardinality) + ' ';
+            for (int c = 0; c < spec.mh; ++c)
+                s += Pattern(spec, i, c) + ' ';
+            for (int c = 0; c < spec.ranges; ++c)
+            {
+                const int lo = Band(spec, i, c) * BAND;
+                s += std::to_string(lo) + ' ' + std::to_string(lo + BAND + spec.overlap) + ' ';
+            }
+            for (int c = 0; c < spec.ae; ++c)
+                s += std::to_string(Hash(spec.seed, i, AE_COLUMN + c) % 1000) + ' ';
+            s += '=';
+            for (int c = 0; c < spec.values; ++c)
+                s += ' ' + Value(spec, i, c);
+            s += '\n';
+        }
+        return s;
+    }
+
+    /// Queries with the criteria of mix, each built from the cells of a random row.
+    struct Queries
+    {
+        std::deque<std::string> strings; // keys and values viewed by kvs
+        std::vector<std::vector<qmex::KeyValue> > kvs;
+
+        Queries(const Spec& spec, int count, unsigned mix)
+        {
+            for (int k = 0; k < count; ++k)
+            {
+                const int i = 1 + (int)(Hash(spec.seed, (unsigned)k, 0xFFFFFFFFu) % (unsigned)spec.rows);
+                std::vector<qmex::KeyValue> q;
+                if (mix & CRITERIA_EQ) for (int c = 0; c < spec.eq; ++c)
+                    q.push_back(qmex::KeyValue(key('E', c), (double)(Hash(spec.seed, i, EQ_COLUMN + c) % (unsigned)spec.cardinality)));
+                if (mix & CRITERIA_MH) for (int c = 0; c < spec.mh; ++c)
+                    q.push_back(qmex::KeyValue(key('M', c), text(Word(spec, i, c))));
+                if (mix & CRITERIA_RANGE) for (int c = 0; c < spec.ranges; ++c)
+                    q.push_back(qmex::KeyValue(key('R', c), (double)(Band(spec, i, c) * BAND + Hash(spec.seed, (unsigned)k, BAND_COLUMN + c) % BAND)));
+                if (mix & CRITERIA_AE) for (int c = 0; c < spec.ae; ++c)
+                    q.push_back(qmex::KeyValue(key('A', c), (double)(Hash(spec.seed, (unsigned)k, AE_COLUMN + c) % 1000)));
+                kvs.push_back(q);
+            }
+        }
+
+    private:
+        const char* text(const std::string& s)
+        {
+            strings.push_back(s);
+            return strings.back().c_str();
+        }
+
+        const char* key(char kind, int c)
+        {
+            return text(kind + std::to_string(c));
+        }
+    };
+}
+
+#endif
@@ -10,7 +10,6 @@
 
 #include <typeinfo>
 #include <iostream>
-#include <fstream>
 #include <vector>
 
 using namespace std;
@@ -21,6 +20,20 @@ int main(int argc, char* argv[]) try
     if (argc < 2)
     {
         printf("Usage: %s </path/to/file>\n", argv[0]);
+        printf("       %s --compile </path/to/table> </path/to/snapshot.qmx>\n", argv[0]);
+        return 0;
+    }
+
+    if (strcmp(argv[1], "--compile") == 0)
+    {
+        if (argc != 4)
+        {
+            printf("Usage: %s --compile </path/to/table> </path/to/snapshot.qmx>\n", argv[0]);
+            return 65534;
+        }
+        Table table;
+        table.load(argv[2], ParseOptions(0));
+        table.save(argv[3]);
         return 0;
     }
 
@@ -46,22 +59,19 @@ int main(int argc, char* argv[]) try
         return r;
     }
 
-    string content;
+    Table table;
+    try
     {
-        ifstream in(argv[1]);
-        if (!in.is_open())
-        {
-            printf("Failed to open file [%s].\n", argv[1]);
-            return 65534;
-        }
-        in.seekg(0, ios_base::end);
-        content.resize(in.tellg());
-        in.seekg(0);
-        in.read(&content[0], (std::streamsize)content.size());
+        if (ext && strcmp(ext, ".qmx") == 0)
+            table.loadCompiled(argv[1]);
+        else
+            table.load(argv[1], ParseOptions(0));
+    }
+    catch (runtime_error& e)
+    {
+        printf("%s.\n", e.what());
+        return 65534;
     }
-
-    Table table;
-    table.parse(&content[0], content.size() + 1);
     // table.print(stdout);
 
     int num_queries = 0;
@@ -7,11 +7,21 @@
 //          https://www.boost.org/LICENSE_1_0.txt)
 //
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <new>
 #include <cmath>
 #include <cassert>
+#include <cctype>
+#include <cstdlib>
 
 #include "qmex.hpp"
 #include "lua.hpp"
@@ -21,8 +31,26 @@ using namespace qmex;
 #ifdef _WIN32
 #pragma comment(lib, "shlwapi.lib")
 extern "C" int __stdcall PathMatchSpecA(const char* pszFile, const char* pszSpec);
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
 #else
 #include <fnmatch.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#define QMEX_X86 1
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define QMEX_TARGET(isa)
+#else
+#define QMEX_TARGET(isa) __attribute__((target(isa)))
+#endif
 #endif
 
 namespace
@@ -67,19 +95,6 @@ namespace
     const int TypeKinds = ArraySize(TypeName);
     const int OpKinds = ArraySize(OpName);
 
-    struct StringGuard
-    {
-        char* const q;
-        char const b;
-        operator char*() const { return q; }
-        ~StringGuard() { if (q) *q = b; }
-        StringGuard(const char* p, char c = '\0')
-            : q(const_cast<char*>(p)), b(p ? *p : '\0')
-        {
-            if (q) *q = c;
-        }
-    };
-
     struct LuaStack
     {
         lua_State* const L;
@@ -159,24 +174,57 @@ namespace
         }
     }
 
-    void EvalLua(lua_State* L, int env, const char* expr, KeyValue& kv) noexcept(false)
+    /// Push the chunk of lua expression expr, compiled and cached in env on first use.
+    void LoadLua(lua_State* L, int env, const char* expr, const char* chunkname) noexcept(false)
     {
-        LuaStack s(L, 1);
+        if (lua_rawgetp(L, env, expr) == LUA_TFUNCTION) return;
+        lua_pop(L, 1);
 
-        if (lua_rawgetp(L, env, expr) != LUA_TFUNCTION)
-        {
-            lua_pop(L, 1);
-     
-            LuaExpr t(expr);
-            if (lua_load(L, &LuaExpr::read, &t, kv.key, "t"))
-                throw LuaError(lua_tostring(L, -1));
-            
-            lua_pushvalue(L, env);
-            lua_setupvalue(L, -2, 1);
+        LuaExpr t(expr);
+        if (lua_load(L, &LuaExpr::read, &t, chunkname, "t"))
+            throw LuaError(lua_tostring(L, -1));
 
-            lua_pushvalue(L, -1);
-            lua_rawsetp(L, env, expr);
-        }
+        lua_pushvalue(L, env);
+        lua_setupvalue(L, -2, 1);
+
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, env, expr);
+    }
+
+    /// Push the function named by expr, evaluated and cached in env on first use.
+    void FindLua(lua_State* L, int env, const char* expr, const char* chunkname) noexcept(false)
+    {
+        if (lua_getfield(L, env, expr) != LUA_TNIL) return;
+        lua_pop(L, 1);
+
+        LuaExpr t(expr);
+        if (lua_load(L, &LuaExpr::read, &t, chunkname, "t"))
+            throw LuaError(lua_tostring(L, -1));
+
+        lua_pushvalue(L, env);
+        lua_setupvalue(L, -2, 1);
+
+        if (lua_pcall(L, 0, 1, 0))
+            throw LuaError(lua_tostring(L, -1));
+
+        lua_pushvalue(L, -1);
+        lua_setfield(L, env, expr);
+    }
+
+    void PushValue(lua_State* L, const KeyValue& kv) noexcept
+    {
+        if (kv.type == NUMBER)
+            lua_pushnumber(L, kv.val.n);
+        else if (kv.type == STRING)
+            lua_pushstring(L, kv.val.s);
+        else
+            lua_pushnil(L);
+    }
+
+    void EvalLua(lua_State* L, int env, const char* expr, KeyValue& kv) noexcept(false)
+    {
+        LuaStack s(L, 1);
+        LoadLua(L, env, expr, kv.key);
 
         if (lua_pcall(L, 0, 1, 0))
             throw LuaError(lua_tostring(L, -1));
@@ -188,24 +236,7 @@ namespace
     void CallLua(lua_State* L, int env, const char* expr, KeyValue& kv, LuaJIT* jit) noexcept(false) try
     {
         LuaStack s(L, 1);
-
-        if (lua_getfield(L, env, expr) == LUA_TNIL)
-        {
-            lua_pop(L, 1);
-
-            LuaExpr t(expr);
-            if (lua_load(L, &LuaExpr::read, &t, kv.key, "t"))
-                throw LuaError(lua_tostring(L, -1));
-
-            lua_pushvalue(L, env);
-            lua_setupvalue(L, -2, 1);
-
-            if(lua_pcall(L, 0, 1, 0))
-                throw LuaError(lua_tostring(L, -1));
-
-            lua_pushvalue(L, -1);
-            lua_setfield(L, env, expr);
-        }
+        FindLua(L, env, expr, kv.key);
 
         if (lua_pcall(L, 0, 1, 0))
             throw LuaError(lua_tostring(L, -1));
@@ -224,6 +255,149 @@ namespace
             throw;
         }
     }
+
+    /// Find the function of a [] cell without calling it, jit it if not found.
+    void ResolveLua(lua_State* L, int env, const char* expr, const char* chunkname, LuaJIT* jit) noexcept(false) try
+    {
+        LuaStack s(L, 1);
+        FindLua(L, env, expr, chunkname);
+        if (lua_isnil(L, -1))
+            throw LuaError("function " + std::string(expr) + " not found");
+    }
+    catch (LuaError&)
+    {
+        if (jit)
+        {
+            jit->jit(L, env, expr);
+            ResolveLua(L, env, expr, chunkname, nullptr);
+        }
+        else
+        {
+            throw;
+        }
+    }
+
+    /// End of the long bracket [[...]] or [==[...]==] at p, nullptr if p is not one.
+    const char* LongBracket(const char* p) noexcept
+    {
+        if (*p != '[') return nullptr;
+        const char* q = p + 1;
+        while (*q == '=') ++q;
+        if (*q != '[') return nullptr;
+        const std::string close = ']' + std::string(p + 1, q) + ']';
+        const char* e = std::strstr(q + 1, close.c_str());
+        return e ? e + close.size() : q + std::strlen(q);
+    }
+
+    template<int N>
+    bool Listed(const std::string& name, const char* const (&list)[N]) noexcept
+    {
+        for (int k = 0; k < N; ++k)
+            if (name == list[k]) return true;
+        return false;
+    }
+
+    /// Skip spaces and comments of lua code at p.
+    const char* SkipSpace(const char* p) noexcept
+    {
+        for (;;)
+        {
+            while (std::isspace((unsigned char)*p)) ++p;
+            if (p[0] != '-' || p[1] != '-') return p;
+            p += 2;
+            if (const char* e = LongBracket(p)) p = e;
+            else while (*p && *p != '\n') ++p;
+        }
+    }
+
+    /// Names lua expression expr reads from _ENV, every identifier but keywords and library fields, so some
+    /// are not read indeed. False unless expr is pure as seen from its text: it only calls the known pure
+    /// library functions and reads no fields of other tables, e.g. cfg.rate, which change without the names.
+    bool PureNames(const char* expr, std::vector<std::string>& names)
+    {
+        const char* const keywords[] = {
+            "and", "break", "do", "else", "elseif", "end", "false", "for", "goto", "if", "in",
+            "local", "nil", "not", "or", "repeat", "return", "then", "true", "until", "while",
+        };
+        const char* const impure[] = { "_ENV", "_G", "function" }; // names unknown until run, closures
+        const char* const libraries[] = { "math", "string", "utf8" };
+        // Functions without side effects, returning the same values for the same arguments, and constants.
+        const char* const pure[] = {
+            "assert", "rawequal", "rawlen", "select", "tonumber", "tostring", "type",
+            "math.abs", "math.acos", "math.asin", "math.atan", "math.atan2", "math.ceil", "math.cos", "math.cosh",
+            "math.deg", "math.exp", "math.floor", "math.fmod", "math.frexp", "math.huge", "math.ldexp", "math.log",
+            "math.log10", "math.max", "math.maxinteger", "math.min", "math.mininteger", "math.modf", "math.pi",
+            "math.pow", "math.rad", "math.sin", "math.sinh", "math.sqrt", "math.tan", "math.tanh", "math.tointeger",
+            "math.type", "math.ult",
+            "string.byte", "string.char", "string.find", "string.format", "string.len", "string.lower",
+            "string.match", "string.rep", "string.reverse", "string.sub", "string.upper",
+            "utf8.char", "utf8.charpattern", "utf8.codepoint", "utf8.len", "utf8.offset",
+        };
+        // Whether the value before q is indexed, or called if not.
+        const auto indexed = [](const char* q) { return *q == '[' || *q == ':' || (*q == '.' && q[1] != '.'); };
+        const auto called = [](const char* q) { return *q == '(' || *q == '"' || *q == '\'' || *q == '{' || LongBracket(q); };
+
+        names.clear();
+        const char* p = expr;
+        while (*p)
+        {
+            const char c = *p;
+            if (const char* e = LongBracket(p))
+            {
+                p = e;
+            }
+            else if (c == '-' && p[1] == '-')
+            {
+                p = SkipSpace(p);
+            }
+            else if (c == '"' || c == '\'')
+            {
+                for (++p; *p && *p != c; ++p)
+                    if (*p == '\\' && p[1]) ++p;
+                if (*p) ++p;
+            }
+            else if (std::isdigit((unsigned char)c))
+            {
+                while (std::isalnum((unsigned char)*p) || *p == '_' || *p == '.') ++p;
+            }
+            else if (c == ')' || c == ']')
+            {
+                const char* q = SkipSpace(++p);
+                if (indexed(q) || called(q)) return false; // e.g. (f)(x) or t[k].x
+            }
+            else if (std::isalpha((unsigned char)c) || c == '_')
+            {
+                const char* b = p;
+                while (std::isalnum((unsigned char)*p) || *p == '_') ++p;
+                const char* q = b;
+                while (q > expr && std::isspace((unsigned char)q[-1])) --q;
+                if (q > expr && ((q[-1] == '.' && (q - 1 == expr || q[-2] != '.')) || q[-1] == ':'))
+                    return false; // a field not seen below
+
+                const std::string name(b, p);
+                if (Listed(name, keywords)) continue;
+                if (Listed(name, impure)) return false;
+                q = SkipSpace(p);
+                if (Listed(name, libraries))
+                {
+                    // Only the listed fields of a library, which is assumed not to be modified.
+                    if (*q != '.' || q[1] == '.') return false;
+                    const char* f = p = SkipSpace(q + 1);
+                    while (std::isalnum((unsigned char)*p) || *p == '_') ++p;
+                    if (!Listed(name + '.' + std::string(f, p), pure) || indexed(SkipSpace(p))) return false;
+                    continue;
+                }
+                if (indexed(q) || (called(q) && !Listed(name, pure))) return false;
+                if (std::find(names.begin(), names.end(), name) == names.end())
+                    names.push_back(name);
+            }
+            else
+            {
+                ++p;
+            }
+        }
+        return true;
+    }
 }
 
 
@@ -495,409 +669,3020 @@ double (Criteria::min)() noexcept
     return 0;
 }
 
-double Criteria::distance(const KeyValue& q) noexcept(false)
+namespace
 {
-    if (const char* s = q.key)
+    bool MatchKey(String key, std::size_t len, String s) noexcept
     {
-        const char* p = key;
-        while (*p && *s && *p == *s) ++p, ++s;
-        if (p[0] == '\0' || p[1] == '\0' || p[2] == '\0' || p[3] != '\0')
-            return -1; // key mismatch
+        return s && std::strncmp(key, s, len) == 0 && s[len] == '\0';
     }
-    if (q.key == nullptr) return -1; // key mismatch
 
-    Number qn;
-    String qs;
-    Criteria t(*this);
-    if (q.type == NUMBER) t.bind(q.val.n);
-    else if (q.type == STRING) t.bind(q.val.s);
-    else t.bind((String)nullptr);
-    if (op == MH) qs = t.val.s;
-    else qn = t.val.n;
+    char Fold(char c) noexcept
+    {
+        return c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c;
+    }
+
+    bool FoldEqual(const char* p, const char* s, std::size_t n) noexcept
+    {
+        for (std::size_t i = 0; i < n; ++i)
+            if (Fold(p[i]) != Fold(s[i])) return false;
+        return true;
+    }
 
-    switch (op)
+    /// Case-insensitive glob [p, pe) with only '*' and '?' against [s, se).
+    bool MatchGlob(const char* p, const char* pe, const char* s, const char* se) noexcept
     {
-    case MH:
-        for (String p = val.s; ;)
+        const char* star = nullptr;
+        const char* back = nullptr;
+        while (s != se)
         {
-            if (StringGuard s = std::strchr(p, '|'))
+            if (p != pe && *p == '*')
+            {
+                star = ++p;
+                back = s;
+            }
+            else if (p != pe && (*p == '?' || Fold(*p) == Fold(*s)))
+            {
+                ++p, ++s;
+            }
+            else if (star)
             {
-                if (MatchString(p, qs)) return 0;
-                p = s + 1;
+                p = star;
+                s = ++back;
             }
             else
             {
-                return MatchString(p, qs) ? 0 : (max)();
+                return false;
             }
         }
-    case EQ: return qn.n == val.n.n ? 0 : (max)();
-    case LT: return qn.n <  val.n.n ? (double)val.n.n - (double)qn.n : (max)();
-    case LE: return qn.n <= val.n.n ? (double)val.n.n - (double)qn.n : (max)();
-    case GT: return qn.n >  val.n.n ? (double)qn.n - (double)val.n.n : (max)();
-    case GE: return qn.n >= val.n.n ? (double)qn.n - (double)val.n.n : (max)();
-    case AE: return std::fabs((double)qn.n - (double)val.n.n);
+        while (p != pe && *p == '*') ++p;
+        return p == pe;
     }
-    return 0;
-}
-
-struct Table::Context
-{
-    std::vector<String> cells;
-    int rows;
-    int cols;
-    int criteria;
-    int cache;
-    bool ownL;
-    bool init;
-    lua_State* L;
-    LuaJIT* jit;
-
-    Context() noexcept : cache(0), ownL(false), init(false) {}
-    ~Context() noexcept { clear(); }
 
-    void clear() noexcept
+    /// Elements built in memory or viewing a mapped snapshot, only built ones can be modified.
+    template<typename T>
+    class Array
     {
-        cells.clear();
-        rows = 0;
-        cols = 0;
-        criteria = 0;
+        std::vector<T> v;
+        const T* p;
+        std::size_t n;
+
+        void sync() noexcept { p = v.data(); n = v.size(); }
+
+    public:
+        Array() noexcept : p(nullptr), n(0) {}
+        Array(const Array& a) : v(a.v), p(v.empty() ? a.p : v.data()), n(a.n) {}
+        Array(Array&& a) noexcept : v(std::move(a.v)), p(a.p), n(a.n) { a.p = nullptr; a.n = 0; }
+        Array& operator=(Array a) noexcept { v.swap(a.v); p = a.p; n = a.n; return *this; }
+
+        /// View data[0, size) owned by others, e.g. a mapped snapshot.
+        void view(const T* data, std::size_t size) noexcept { std::vector<T>().swap(v); p = data; n = size; }
+
+        std::size_t size() const noexcept { return n; }
+        bool empty() const noexcept { return n == 0; }
+        const T* data() const noexcept { return p; }
+        const T* begin() const noexcept { return p; }
+        const T* end() const noexcept { return p + n; }
+        const T& operator[](std::size_t i) const noexcept { return p[i]; }
+        const T& back() const noexcept { return p[n - 1]; }
+
+        // Elements are only written while built, p is v.data() then.
+        T* begin() noexcept { return const_cast<T*>(p); }
+        T* end() noexcept { return const_cast<T*>(p + n); }
+        T& operator[](std::size_t i) noexcept { return const_cast<T&>(p[i]); }
+        T& back() noexcept { return const_cast<T&>(p[n - 1]); }
+        void push_back(const T& x) { v.push_back(x); sync(); }
+        void append(const T* first, const T* last) { v.insert(v.end(), first, last); sync(); }
+        void assign(std::size_t size, const T& x) { v.assign(size, x); sync(); }
+        void resize(std::size_t size) { v.resize(size); sync(); }
+        void reserve(std::size_t size) { v.reserve(size); sync(); }
+        void clear() noexcept { v.clear(); sync(); }
+    };
 
-        if (cache > 0)
-        {
-            lua_pushnil(L);
-            lua_setiuservalue(L, 1, cache);
-        }
-        else if (init && L)
+    /// One alternative of a MH pattern, compiled to the cheapest way to match it.
+    struct Glob
+    {
+        enum Kind
         {
-            luaL_unref(L, LUA_REGISTRYINDEX, -cache);
-            cache = 0;
-        }
+            LITERAL,  // no wildcard
+            PREFIX,   // text*
+            SUFFIX,   // *text
+            WILDCARD, // '*' and '?' anywhere
+            NATIVE,   // bracket expressions, left to the platform matcher
+        };
 
-        if (ownL && L)
+        std::size_t offset; // of text in the pool
+        std::size_t len;
+        Kind kind;
+        int unused;         // no padding, snapshots are byte exact
+
+        static Glob compile(const char* p, const char* pe, Array<char>& pool)
         {
-            lua_close(L);
-        }
+            Glob g = { 0, (std::size_t)(pe - p), LITERAL, 0 };
+            std::size_t stars = 0, marks = 0;
+            for (const char* c = p; c != pe; ++c)
+            {
+                if (*c == '[') g.kind = NATIVE;
+                else if (*c == '*') ++stars;
+                else if (*c == '?') ++marks;
+            }
 
-        ownL = false;
-        init = false;
-        L = nullptr;
-        jit = nullptr;
-    }
+            if (g.kind == NATIVE)
+            {
+                g.offset = pool.size();
+                pool.append(p, pe);
+                pool.push_back('\0');
+                return g;
+            }
 
-    int env() noexcept
-    {
-        if (cache > 0)
-        {
-            lua_getiuservalue(L, 1, cache);
+            if (stars == 1 && marks == 0 && pe[-1] == '*') g.kind = PREFIX, --pe;
+            else if (stars == 1 && marks == 0 && p[0] == '*') g.kind = SUFFIX, ++p;
+            else if (stars || marks) g.kind = WILDCARD;
+
+            g.offset = pool.size();
+            g.len = (std::size_t)(pe - p);
+            for (; p != pe; ++p) pool.push_back(Fold(*p));
+            pool.push_back('\0');
+            return g;
         }
-        else
+
+        bool match(const char* pool, String s, std::size_t n) const noexcept
         {
-            lua_rawgeti(L, LUA_REGISTRYINDEX, -cache);
+            const char* p = pool + offset;
+            switch (kind)
+            {
+            case LITERAL: return n == len && FoldEqual(p, s, n);
+            case PREFIX: return n >= len && FoldEqual(p, s, len);
+            case SUFFIX: return n >= len && FoldEqual(p, s + n - len, len);
+            case WILDCARD: return MatchGlob(p, p + len, s, s + n);
+            case NATIVE: return MatchString(p, s);
+            }
+            return false;
         }
-        return lua_gettop(L);
-    }
+    };
 
-    lua_State* lua() noexcept
+    /// Match s against '|' separated patterns without compiling them.
+    bool MatchPatterns(String patterns, String s) noexcept
     {
-        if (L == nullptr)
-        {
-            ownL = true;
-            L = luaL_newstate();
-            luaL_openlibs(L);
-        }
-        if (!init)
+        const std::size_t n = std::strlen(s);
+        for (String p = patterns; ; ++p)
         {
-            LuaStack s(L, 0);
-            lua_createtable(L, 0, 1); // env
-            lua_pushglobaltable(L);
-            lua_setfield(L, -2, "__index");
-            lua_pushvalue(L, -1);
-            lua_setmetatable(L, -2);
-
-            if (cache > 0)
+            String e = std::strchr(p, '|');
+            if (e == nullptr) e = p + std::strlen(p);
+            if (std::find(p, e, '[') != e)
             {
-                lua_setiuservalue(L, 1, cache);
+                std::string pattern(p, e);
+                if (MatchString(pattern.c_str(), s)) return true;
             }
-            else
+            else if (MatchGlob(p, e, s, s + n))
             {
-                cache = -luaL_ref(L, LUA_REGISTRYINDEX);
+                return true;
             }
-            init = true;
+            if (*e == '\0') return false;
+            p = e;
         }
-        return L;
     }
-};
-
-Table::Table() noexcept : ctx(new Context) {}
-Table::~Table() noexcept { delete ctx; }
-void Table::clear() noexcept { ctx->clear(); }
-int Table::rows() const noexcept { return ctx->rows; }
-int Table::cols() const noexcept { return ctx->cols; }
-int Table::criteria() const noexcept { return ctx->criteria; }
 
-String Table::cell(int i, int j) const noexcept(false)
-{
-    if (i < 0 || i >= ctx->rows || j < 0 || j >= ctx->cols)
-    {
-        char buf[200];
-        snprintf(buf, sizeof(buf), "index (%d,%d) out of range %dx%d", i, j, ctx->rows, ctx->cols);
-        throw std::out_of_range(buf);
-    }
-    return ctx->cells[i * ctx->cols + j];
-}
+    /// Distance in units of NUMBER, always finite as both operands are 32-bit.
+    typedef unsigned long long Distance;
 
-void Table::print(FILE* f) const noexcept
-{
-    for (int i = 0; i < ctx->rows; ++i)
+    /// Measure the distance from query value q to criteria value c, false if q does not meet c.
+    bool Measure(Op op, Number::integer c, Number::integer q, Distance& d) noexcept
     {
-        for (int j = 0; j < ctx->cols; ++j)
+        switch (op)
         {
-            if (j == ctx->criteria)
-                std::fprintf(f, "%s ", "=");
-            std::fprintf(f, "%s ", cell(i, j));
+        case EQ: d = 0; return q == c;
+        case LT: d = (Distance)((long long)c - q); return q <  c;
+        case LE: d = (Distance)((long long)c - q); return q <= c;
+        case GT: d = (Distance)((long long)q - c); return q >  c;
+        case GE: d = (Distance)((long long)q - c); return q >= c;
+        case AE: d = (Distance)(q < c ? (long long)c - q : (long long)q - c); return true;
+        default: d = 0; return true;
         }
-        std::fputc('\n', f);
     }
 }
 
-void Table::parse(char* buf, std::size_t bufsz, lua_State* L, LuaJIT* jit) noexcept(false)
+double Criteria::distance(const KeyValue& q) const noexcept(false)
 {
-    if (buf == nullptr || bufsz == 0 || buf[bufsz - 1] != '\0')
-        throw std::invalid_argument("invalid buffer input for table parse");
-
-    clear();
-    ctx->L = L;
-    ctx->jit = jit;
+    if (!MatchKey(key, std::strlen(key) - 3, q.key))
+        return -1; // key mismatch
 
-    int j = 0, criteria = 0;
-    String cell = nullptr;
-    char quote = '\0';
-    for (std::size_t i = 0; i < bufsz; ++i)
-    {
-        switch (char& c = buf[i])
-        {
-        case '\0':
-        case '\r':
-        case '\n':
-            if (j != 0)
-            {
-                if (quote)
-                {
-                    char str[200];
-                    snprintf(str, sizeof(str), "Table has non-enclosed quote %c at row %d", quote, ctx->rows);
-                    throw TableFormatError(str);
-                }
-                if (ctx->cols == 0)
-                    ctx->cols = j;
-                if (criteria == 0 || criteria == j)
-                {
-                    char str[200];
-                    snprintf(str, sizeof(str), "Table has no data at row %d", ctx->rows);
-                    throw TableFormatError(str);
-                }
-                if (ctx->cols != j)
-                {
-                    char str[200];
-                    snprintf(str, sizeof(str), "Table has %d columns but %d at row %d", ctx->cols, j, ctx->rows);
-                    throw TableFormatError(str);
-                }
-                ++ctx->rows;
-                j = 0;
-                criteria = 0;
-            }
-            goto end;
-        case ' ':
-        case '\t':
-        //case ',':
-        case '=':
-            if (quote) continue;
-            if (c == '=' && criteria == 0)
-            {
-                criteria = j;
-                if (ctx->criteria == 0)
-                    ctx->criteria = j;
-                if (ctx->criteria != j)
-                {
-                    char str[200];
-                    snprintf(str, sizeof(str), "Table has %d criteria but %d at row %d", ctx->criteria, j, ctx->rows);
-                    throw TableFormatError(str);
-                }
-                else if (j == 0)
-                {
-                    char str[200];
-                    snprintf(str, sizeof(str), "Table has no criteria at row %d", ctx->rows);
-                    throw TableFormatError(str);
-                }
-            }
-        end:
-            if (cell)
-            {
-                if (quote)
-                {
-                    ++cell;
-                    quote = '\0';
-                }
-                ctx->cells.push_back(cell);
-                cell = nullptr;
-                c = '\0';
-            }
-            break;
-        case '\'':
-        case '"':
-        case '`':
-        case '!':
-        case '$':
-        case '%':
-            if (!cell) quote = c;
-            else if (quote == c) goto end;
-            //[[fallthrough]];
-        default:
-            if (!cell) // start a new cell
-            {
-                cell = &c;
-                ++j;
-            }
-        }
-    }
+    Criteria t(*this);
+    if (q.type == NUMBER) t.bind(q.val.n);
+    else if (q.type == STRING) t.bind(q.val.s);
+    else t.bind((String)nullptr);
 
-    assert((int)ctx->cells.size() == ctx->rows * ctx->cols);
-    if (ctx->cells.empty()) throw TableFormatError("Table is empty");
+    Distance d;
+    if (op == MH) return MatchPatterns(val.s, t.val.s) ? 0 : (max)();
+    return Measure(op, val.n.n, t.val.n.n, d) ? (double)d : (max)();
 }
 
 namespace
 {
-    struct QueryInfo : Criteria
+    /// Word of row bitmaps, bit r for body row r + 1.
+    typedef unsigned long long Word;
+    enum { WORD_BITS = 64 };
+
+    int Popcount(Word w) noexcept
     {
-        int index; // of matched kvs[], -1 not matched yet, -2 no match found.
-        int count;
-        QueryInfo(Criteria c) : Criteria(c), index(-1), count(0) {}
-    };
-}
+#if defined(_MSC_VER) && !defined(__clang__) && defined(_M_X64)
+        return (int)__popcnt64(w);
+#elif defined(_MSC_VER) && !defined(__clang__)
+        return (int)(__popcnt((unsigned)w) + __popcnt((unsigned)(w >> 32)));
+#else
+        return __builtin_popcountll(w);
+#endif
+    }
 
-int Table::query(const KeyValue kvs[], std::size_t num, unsigned options) noexcept(false)
-{
-    int min_i = 0;
-    if (ctx->rows <= 1) return min_i;
+    int Lowest(Word w) noexcept
+    {
+#if defined(_MSC_VER) && !defined(__clang__)
+        unsigned long i = 0;
+        if (_BitScanForward(&i, (unsigned long)w)) return (int)i;
+        _BitScanForward(&i, (unsigned long)(w >> 32));
+        return (int)i + 32;
+#else
+        return __builtin_ctzll(w);
+#endif
+    }
 
-    std::vector<QueryInfo> info;
-    info.reserve(ctx->criteria);
-    for (int j = 0; j < ctx->criteria; ++j) try
+    std::size_t Hash(Number::integer n) noexcept
     {
-        info.push_back(Criteria(cell(0, j)));
+        return (std::size_t)((unsigned)n * 2654435761u);
     }
-    catch (CriteriaFormatError& e)
+
+    std::size_t FoldHash(const char* s, std::size_t n) noexcept
     {
-        char buf[200];
-        snprintf(buf, sizeof(buf), "Table row:%d, col:%d\n", 0, j + 1);
-        throw TableFormatError(std::string(buf) + e.what());
+        std::size_t h = 2166136261u;
+        for (std::size_t i = 0; i < n; ++i)
+            h = (h ^ (unsigned char)Fold(s[i])) * 16777619u;
+        return h;
     }
 
-    int matched = 0;
-    double min_d = (Criteria::max)();
-    for (int i = 1; i < ctx->rows; ++i)
+    /// Body rows grouped by key, found by open addressing on key hashes.
+    /// The keys are owner defined, e.g. offsets of text or the values themselves.
+    struct RowIndex
     {
-        double sum_d = 0;
-        for (int j = 0; j < (int)info.size(); ++j)
+        Array<std::size_t> hashes; // of groups
+        Array<long long> keys;     // of groups
+        Array<int> offsets;        // rows of group k are rows[offsets[k], offsets[k + 1])
+        Array<int> rows;
+        Array<int> slots;          // group + 1, 0 if empty
+
+        /// Room for up to n rows.
+        void reserve(std::size_t n)
         {
-            if (info[j].index == -2) continue;
-            try
-            {
-                info[j].bind(cell(i, j));
-            }
-            catch (std::exception& e)
+            hashes.reserve(n);
+            keys.reserve(n);
+            offsets.reserve(n + 1);
+            rows.reserve(n);
+        }
+
+        void add(std::size_t hash, long long key, int row)
+        {
+            if (offsets.empty()) offsets.push_back(0);
+            hashes.push_back(hash);
+            keys.push_back(key);
+            rows.push_back(row);
+            offsets.push_back((int)rows.size());
+        }
+
+        void append(int row)
+        {
+            if (rows.back() == row) return;
+            rows.push_back(row);
+            offsets.back() = (int)rows.size();
+        }
+
+        void build()
+        {
+            std::size_t n = 1;
+            while (n < hashes.size() * 2) n *= 2;
+            slots.assign(n, 0);
+            for (std::size_t k = 0; k < hashes.size(); ++k)
             {
-                char buf[200];
-                snprintf(buf, sizeof(buf), "Table row:%d, col:%d\n", i, j + 1);
-                throw TableFormatError(std::string(buf) + e.what());
+                std::size_t s = hashes[k] & (n - 1);
+                while (slots[s]) s = (s + 1) & (n - 1);
+                slots[s] = (int)k + 1;
             }
-            if (info[j].index >= 0)
+        }
+
+        /// Find the group whose key satisfies eq(key), -1 if none.
+        template<typename Eq>
+        int find(std::size_t hash, Eq eq) const noexcept
+        {
+            if (slots.empty()) return -1;
+            const std::size_t n = slots.size();
+            for (std::size_t s = hash & (n - 1); slots[s]; s = (s + 1) & (n - 1))
             {
-                double d = info[j].distance(kvs[info[j].index]);
-                if (d < 0) continue; // never happen
-                sum_d += d;
-                if (sum_d >= min_d) goto next;
-                continue;
+                const int k = slots[s] - 1;
+                if (hashes[k] == hash && eq(keys[k])) return k;
             }
-            for (std::size_t k = 0; k < num; ++k)
-            {
-                double d = info[j].distance(kvs[k]);
-                if (d < 0) continue; // key mismatch
-                info[j].index = (int)k;
-                sum_d += d;
-                ++matched;
-                if (sum_d >= min_d) goto next;
+            return -1;
+        }
+
+        void mark(int k, Word bits[]) const noexcept
+        {
+            for (int i = offsets[k]; i < offsets[k + 1]; ++i)
+                bits[rows[i] / WORD_BITS] |= Word(1) << (rows[i] % WORD_BITS);
+        }
+
+        /// Check a restored index of body rows [0, body), find() and mark() stay in bounds then.
+        bool valid(std::size_t body) const noexcept
+        {
+            const std::size_t groups = hashes.size();
+            if (keys.size() != groups || offsets.size() != (groups ? groups + 1 : 0))
+                return false;
+            if (groups ? offsets[0] != 0 || (std::size_t)offsets.back() != rows.size() : !rows.empty())
+                return false;
+            for (std::size_t k = 1; k < offsets.size(); ++k)
+                if (offsets[k] < offsets[k - 1]) return false;
+            for (std::size_t i = 0; i < rows.size(); ++i)
+                if (rows[i] < 0 || (std::size_t)rows[i] >= body) return false;
+            if (slots.empty()) return groups == 0;
+            if (slots.size() & (slots.size() - 1)) return false;
+            bool free = false; // probing stops at an empty slot
+            for (std::size_t s = 0; s < slots.size(); ++s)
+            {
+                if (slots[s] < 0 || (std::size_t)slots[s] > groups) return false;
+                if (slots[s] == 0) free = true;
+            }
+            return free;
+        }
+    };
+}
+
+namespace
+{
+    /// Criteria of a table column, compiled from the header by Table::parse.
+    struct Column : Criteria
+    {
+        int index;       // of table columns
+        std::size_t len; // of key without the operator suffix
+        Array<Number::integer> numbers; // decoded cells of body rows, [i - 1] for row i
+        Array<Glob> globs;              // compiled MH alternatives of body rows
+        Array<std::size_t> spans;       // globs of row i are [spans[i - 1], spans[i])
+        Array<char> pool;               // text of globs
+        RowIndex literals;              // rows by case-folded LITERAL globs
+        RowIndex values;                // rows by decoded EQ numbers
+        Array<Word> wild;               // bitmap of rows with any other glob
+
+        void compile(int i, String patterns)
+        {
+            if (spans.empty()) spans.push_back(0);
+            for (String p = patterns; ; ++p)
+            {
+                String e = std::strchr(p, '|');
+                if (e == nullptr) e = p + std::strlen(p);
+                globs.push_back(Glob::compile(p, e, pool));
+                if (*e == '\0') break;
+                p = e;
+            }
+            spans.push_back(globs.size());
+            assert((int)spans.size() == i + 1);
+        }
+
+        /// Compile row i as the same patterns of row k of other.
+        void compile(int i, const Column& other, int k)
+        {
+            if (spans.empty()) spans.push_back(0);
+            for (std::size_t n = other.spans[k - 1]; n < other.spans[k]; ++n)
+            {
+                Glob g = other.globs[n];
+                g.offset = pool.size();
+                pool.append(other.pool.data() + other.globs[n].offset, other.pool.data() + other.globs[n].offset + g.len + 1);
+                globs.push_back(g);
+            }
+            spans.push_back(globs.size());
+            assert((int)spans.size() == i + 1);
+        }
+
+        void build(int rows)
+        {
+            std::vector<std::pair<std::string, int> > lits;
+            lits.reserve(globs.size());
+            wild.assign((rows - 1 + WORD_BITS - 1) / WORD_BITS, 0);
+            for (int i = 1; i < rows; ++i)
+            {
+                for (std::size_t k = spans[i - 1]; k < spans[i]; ++k)
+                {
+                    const Glob& g = globs[k];
+                    if (g.kind == Glob::LITERAL)
+                        lits.push_back(std::make_pair(std::string(pool.data() + g.offset, g.len), i - 1));
+                    else
+                        wild[(i - 1) / WORD_BITS] |= Word(1) << ((i - 1) % WORD_BITS);
+                }
+            }
+
+            std::sort(lits.begin(), lits.end());
+            literals.reserve(lits.size());
+            for (std::size_t k = 0; k < lits.size(); ++k)
+            {
+                if (k > 0 && lits[k].first == lits[k - 1].first)
+                {
+                    literals.append(lits[k].second);
+                    continue;
+                }
+                const std::string& t = lits[k].first;
+                const std::size_t offset = pool.size();
+                pool.append(t.c_str(), t.c_str() + t.size() + 1);
+                literals.add(FoldHash(t.data(), t.size()), (long long)offset, lits[k].second);
+            }
+            literals.build();
+        }
+
+        void build()
+        {
+            std::vector<std::pair<Number::integer, int> > nums;
+            nums.reserve(numbers.size());
+            for (int r = 0; r < (int)numbers.size(); ++r)
+                nums.push_back(std::make_pair(numbers[r], r));
+            std::sort(nums.begin(), nums.end());
+            values.reserve(nums.size());
+            for (std::size_t k = 0; k < nums.size(); ++k)
+            {
+                if (k > 0 && nums[k].first == nums[k - 1].first)
+                    values.append(nums[k].second);
+                else
+                    values.add(Hash(nums[k].first), nums[k].first, nums[k].second);
+            }
+            values.build();
+        }
+
+        /// Mark rows equal to q.
+        void candidates(Number::integer q, Word bits[]) const noexcept
+        {
+            int k = values.find(Hash(q), [=](long long key) { return key == q; });
+            if (k >= 0) values.mark(k, bits);
+        }
+
+        /// Mark rows possibly matching s.
+        void candidates(String s, std::size_t n, Word bits[]) const noexcept
+        {
+            for (std::size_t w = 0; w < wild.size(); ++w)
+                bits[w] |= wild[w];
+            const char* text = pool.data();
+            int k = literals.find(FoldHash(s, n), [=](long long key) {
+                return FoldEqual(text + key, s, n) && text[key + n] == '\0';
+            });
+            if (k >= 0) literals.mark(k, bits);
+        }
+
+        bool match(int i, String s, std::size_t n) const noexcept
+        {
+            for (std::size_t k = spans[i - 1]; k < spans[i]; ++k)
+                if (globs[k].match(pool.data(), s, n)) return true;
+            return false;
+        }
+
+        /// Check a restored column of body rows [0, body), all offsets and indexes stay in bounds then.
+        bool valid(std::size_t body) const noexcept
+        {
+            if (op != MH)
+                return numbers.size() == body && globs.empty() && spans.empty() && pool.empty() &&
+                       literals.hashes.empty() && wild.empty() && values.valid(body) && (op == EQ || values.hashes.empty());
+            if (!numbers.empty() || !values.hashes.empty() || !literals.valid(body)) return false;
+            if (body == 0) return globs.empty() && spans.empty() && pool.empty() && wild.empty();
+            if (spans.size() != body + 1 || spans[0] != 0 || spans.back() != globs.size() ||
+                wild.size() != (body + WORD_BITS - 1) / WORD_BITS || pool.empty() || pool.back() != '\0')
+                return false;
+            for (std::size_t i = 1; i < spans.size(); ++i)
+                if (spans[i] < spans[i - 1]) return false;
+            for (std::size_t k = 0; k < globs.size(); ++k)
+            {
+                const Glob& g = globs[k];
+                if ((unsigned)g.kind > Glob::NATIVE || g.offset >= pool.size() ||
+                    g.len >= pool.size() - g.offset || pool[g.offset + g.len] != '\0')
+                    return false;
+            }
+            for (std::size_t k = 0; k < literals.keys.size(); ++k)
+                if (literals.keys[k] < 0 || (unsigned long long)literals.keys[k] >= pool.size()) return false;
+            return true;
+        }
+
+        Column(String key, int index) noexcept(false)
+            : Criteria(key), index(index), len(std::strlen(key) - 3) {}
+    };
+}
+
+namespace
+{
+    /// NUMBER criteria of a query bound to a decoded column.
+    struct Term
+    {
+        const Number::integer* c;
+        Number::integer q;
+        Op op;
+    };
+
+    const Distance NoMatch = (std::numeric_limits<Distance>::max)();
+
+    /// Sum up distances of terms[0, n) at body rows [r, r + count) into d[], NoMatch if any term does not match.
+    typedef void (*ScanKernel)(const Term terms[], std::size_t n, int r, int count, Distance d[]);
+
+    void ScanScalar(const Term terms[], std::size_t n, int r, int count, Distance d[]) noexcept
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            Distance sum = 0;
+            for (std::size_t j = 0; j < n; ++j)
+            {
+                Distance x;
+                if (!Measure(terms[j].op, terms[j].c[r + i], terms[j].q, x))
+                {
+                    sum = NoMatch;
+                    break;
+                }
+                sum += x;
+            }
+            d[i] = sum;
+        }
+    }
+
+#ifdef QMEX_X86
+    // Lanes hold 32-bit criteria values. A distance always fits in an unsigned
+    // 32-bit lane, so it is computed with wrapping subtraction and then widened
+    // to 64-bit accumulators. Rows not meeting a term are collected in a mask.
+
+    QMEX_TARGET("sse4.1")
+    void ScanSSE41(const Term terms[], std::size_t n, int r, int count, Distance d[]) noexcept
+    {
+        int i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128i lo = _mm_setzero_si128();
+            __m128i hi = _mm_setzero_si128();
+            __m128i fail = _mm_setzero_si128();
+            for (std::size_t j = 0; j < n; ++j)
+            {
+                const __m128i c = _mm_loadu_si128((const __m128i*)(terms[j].c + r + i));
+                const __m128i q = _mm_set1_epi32(terms[j].q);
+                __m128i x;
+                switch (terms[j].op)
+                {
+                case EQ: x = _mm_setzero_si128(); fail = _mm_or_si128(fail, _mm_xor_si128(_mm_cmpeq_epi32(c, q), _mm_set1_epi32(-1))); break;
+                case LT: x = _mm_sub_epi32(c, q); fail = _mm_or_si128(fail, _mm_xor_si128(_mm_cmpgt_epi32(c, q), _mm_set1_epi32(-1))); break;
+                case LE: x = _mm_sub_epi32(c, q); fail = _mm_or_si128(fail, _mm_cmpgt_epi32(q, c)); break;
+                case GT: x = _mm_sub_epi32(q, c); fail = _mm_or_si128(fail, _mm_xor_si128(_mm_cmpgt_epi32(q, c), _mm_set1_epi32(-1))); break;
+                case GE: x = _mm_sub_epi32(q, c); fail = _mm_or_si128(fail, _mm_cmpgt_epi32(c, q)); break;
+                case AE: x = _mm_sub_epi32(_mm_max_epi32(c, q), _mm_min_epi32(c, q)); break;
+                default: x = _mm_setzero_si128(); break;
+                }
+                lo = _mm_add_epi64(lo, _mm_cvtepu32_epi64(x));
+                hi = _mm_add_epi64(hi, _mm_cvtepu32_epi64(_mm_srli_si128(x, 8)));
+            }
+            lo = _mm_or_si128(lo, _mm_cvtepi32_epi64(fail));
+            hi = _mm_or_si128(hi, _mm_cvtepi32_epi64(_mm_srli_si128(fail, 8)));
+            _mm_storeu_si128((__m128i*)(d + i), lo);
+            _mm_storeu_si128((__m128i*)(d + i + 2), hi);
+        }
+        ScanScalar(terms, n, r + i, count - i, d + i);
+    }
+
+    QMEX_TARGET("avx2")
+    void ScanAVX2(const Term terms[], std::size_t n, int r, int count, Distance d[]) noexcept
+    {
+        int i = 0;
+        for (; i + 8 <= count; i += 8)
+        {
+            __m256i lo = _mm256_setzero_si256();
+            __m256i hi = _mm256_setzero_si256();
+            __m256i fail = _mm256_setzero_si256();
+            for (std::size_t j = 0; j < n; ++j)
+            {
+                const __m256i c = _mm256_loadu_si256((const __m256i*)(terms[j].c + r + i));
+                const __m256i q = _mm256_set1_epi32(terms[j].q);
+                __m256i x;
+                switch (terms[j].op)
+                {
+                case EQ: x = _mm256_setzero_si256(); fail = _mm256_or_si256(fail, _mm256_xor_si256(_mm256_cmpeq_epi32(c, q), _mm256_set1_epi32(-1))); break;
+                case LT: x = _mm256_sub_epi32(c, q); fail = _mm256_or_si256(fail, _mm256_xor_si256(_mm256_cmpgt_epi32(c, q), _mm256_set1_epi32(-1))); break;
+                case LE: x = _mm256_sub_epi32(c, q); fail = _mm256_or_si256(fail, _mm256_cmpgt_epi32(q, c)); break;
+                case GT: x = _mm256_sub_epi32(q, c); fail = _mm256_or_si256(fail, _mm256_xor_si256(_mm256_cmpgt_epi32(q, c), _mm256_set1_epi32(-1))); break;
+                case GE: x = _mm256_sub_epi32(q, c); fail = _mm256_or_si256(fail, _mm256_cmpgt_epi32(c, q)); break;
+                case AE: x = _mm256_sub_epi32(_mm256_max_epi32(c, q), _mm256_min_epi32(c, q)); break;
+                default: x = _mm256_setzero_si256(); break;
+                }
+                lo = _mm256_add_epi64(lo, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(x)));
+                hi = _mm256_add_epi64(hi, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(x, 1)));
+            }
+            lo = _mm256_or_si256(lo, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(fail)));
+            hi = _mm256_or_si256(hi, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(fail, 1)));
+            _mm256_storeu_si256((__m256i*)(d + i), lo);
+            _mm256_storeu_si256((__m256i*)(d + i + 4), hi);
+        }
+        ScanScalar(terms, n, r + i, count - i, d + i);
+    }
+
+    bool HasSSE41() noexcept
+    {
+#if defined(_MSC_VER) && !defined(__clang__)
+        int info[4];
+        __cpuid(info, 1);
+        return (info[2] & (1 << 19)) != 0;
+#else
+        return __builtin_cpu_supports("sse4.1") != 0;
+#endif
+    }
+
+    bool HasAVX2() noexcept
+    {
+#if defined(_MSC_VER) && !defined(__clang__)
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7) return false;
+        __cpuid(info, 1);
+        const int osxsave_avx = (1 << 27) | (1 << 28);
+        if ((info[2] & osxsave_avx) != osxsave_avx) return false;
+        if ((_xgetbv(0) & 6) != 6) return false; // XMM and YMM states enabled by OS
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+#else
+        return __builtin_cpu_supports("avx2") != 0;
+#endif
+    }
+#endif
+
+    /// Select the widest kernel supported by the running CPU, QMEX_SIMD=avx2|sse4.1|scalar caps it.
+    ScanKernel SelectKernel() noexcept
+    {
+        const char* cap = std::getenv("QMEX_SIMD");
+        if (cap == nullptr) cap = "";
+#ifdef QMEX_X86
+        if (std::strcmp(cap, "scalar") && std::strcmp(cap, "sse4.1") && HasAVX2()) return &ScanAVX2;
+        if (std::strcmp(cap, "scalar") && HasSSE41()) return &ScanSSE41;
+#endif
+        return &ScanScalar;
+    }
+
+    ScanKernel Kernel() noexcept
+    {
+        static const ScanKernel kernel = SelectKernel();
+        return kernel;
+    }
+}
+
+namespace
+{
+    /// Centered interval tree of the closed bounds [lo, hi] of body rows.
+    struct IntervalTree
+    {
+        struct Node
+        {
+            long long center;
+            int left, right;  // child nodes, -1 if none
+            int begin, end;   // intervals containing center are [begin, end) of byLo and byHi
+        };
+
+        Array<long long> lo, hi; // of body rows
+        Array<Node> nodes;       // nodes[0] is the root
+        Array<int> byLo;         // rows by lo ascending within a node
+        Array<int> byHi;         // rows by hi descending within a node
+
+        void build()
+        {
+            std::vector<int> rows;
+            rows.reserve(lo.size());
+            for (int r = 0; r < (int)lo.size(); ++r)
+                if (lo[r] <= hi[r]) rows.push_back(r); // never matched otherwise
+            byLo.reserve(rows.size());
+            byHi.reserve(rows.size());
+            if (!rows.empty()) build(rows);
+        }
+
+        int build(std::vector<int>& rows)
+        {
+            std::vector<long long> ends;
+            ends.reserve(rows.size() * 2);
+            for (std::size_t k = 0; k < rows.size(); ++k)
+            {
+                ends.push_back(lo[rows[k]]);
+                ends.push_back(hi[rows[k]]);
+            }
+            std::nth_element(ends.begin(), ends.begin() + ends.size() / 2, ends.end());
+
+            const int n = (int)nodes.size();
+            Node node = { ends[ends.size() / 2], -1, -1, (int)byLo.size(), 0 };
+            nodes.push_back(node);
+
+            std::vector<int> left, right;
+            for (std::size_t k = 0; k < rows.size(); ++k)
+            {
+                const int r = rows[k];
+                if (hi[r] < node.center) left.push_back(r);
+                else if (lo[r] > node.center) right.push_back(r);
+                else byLo.push_back(r), byHi.push_back(r);
+            }
+            nodes[n].end = (int)byLo.size();
+
+            const Array<long long>& l = lo;
+            const Array<long long>& h = hi;
+            std::stable_sort(byLo.begin() + node.begin, byLo.end(), [&l](int a, int b) { return l[a] < l[b]; });
+            std::stable_sort(byHi.begin() + node.begin, byHi.end(), [&h](int a, int b) { return h[a] > h[b]; });
+
+            rows.clear();
+            if (!left.empty())
+            {
+                const int child = build(left); // may reallocate nodes
+                nodes[n].left = child;
+            }
+            if (!right.empty())
+            {
+                const int child = build(right);
+                nodes[n].right = child;
+            }
+            return n;
+        }
+
+        /// Mark rows whose interval contains q.
+        void mark(long long q, Word bits[]) const noexcept
+        {
+            for (int n = nodes.empty() ? -1 : 0; n >= 0; )
+            {
+                const Node& node = nodes[n];
+                int k = node.begin;
+                if (q < node.center)
+                {
+                    for (; k < node.end && lo[byLo[k]] <= q; ++k)
+                        bits[byLo[k] / WORD_BITS] |= Word(1) << (byLo[k] % WORD_BITS);
+                    n = node.left;
+                }
+                else if (q > node.center)
+                {
+                    for (; k < node.end && hi[byHi[k]] >= q; ++k)
+                        bits[byHi[k] / WORD_BITS] |= Word(1) << (byHi[k] % WORD_BITS);
+                    n = node.right;
+                }
+                else
+                {
+                    for (; k < node.end; ++k)
+                        bits[byLo[k] / WORD_BITS] |= Word(1) << (byLo[k] % WORD_BITS);
+                    break;
+                }
+            }
+        }
+
+        /// Check a restored tree of body rows [0, body), mark() stays in bounds and terminates then.
+        bool valid(std::size_t body) const noexcept
+        {
+            if (lo.size() != body || hi.size() != body || byLo.size() != byHi.size()) return false;
+            for (std::size_t k = 0; k < byLo.size(); ++k)
+                if (byLo[k] < 0 || (std::size_t)byLo[k] >= body || byHi[k] < 0 || (std::size_t)byHi[k] >= body)
+                    return false;
+            for (std::size_t n = 0; n < nodes.size(); ++n)
+            {
+                const Node& node = nodes[n];
+                // children are built after their parent, so descending always ends
+                if ((node.left >= 0 && (std::size_t)node.left <= n) || node.left < -1 || node.left >= (int)nodes.size() ||
+                    (node.right >= 0 && (std::size_t)node.right <= n) || node.right < -1 || node.right >= (int)nodes.size() ||
+                    node.begin < 0 || node.begin > node.end || (std::size_t)node.end > byLo.size())
+                    return false;
+            }
+            return true;
+        }
+    };
+
+    /// Range criteria (GE/GT and LT/LE) over the same key, e.g. Score.GE and Score.LT.
+    struct Range
+    {
+        int lower; // of Context::columns, -1 if none
+        int upper; // of Context::columns, -1 if none
+        IntervalTree tree;
+    };
+
+    /// Mark bytes of p[0, n) that may separate, quote or end cells, n <= WORD_BITS.
+    /// Other bytes may be marked too, the tokenizer treats them as ordinary ones.
+    typedef Word (*ClassifyKernel)(const char* p, std::size_t n);
+
+    Word ClassifyScalar(const char* p, std::size_t n) noexcept
+    {
+        Word m = 0;
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            const unsigned char c = (unsigned char)p[i];
+            if (c <= '\'' || c == '=' || c == '`') m |= Word(1) << i;
+        }
+        return m;
+    }
+
+#ifdef QMEX_X86
+    // Whitespace, line breaks and all quotes but '`' are bytes <= '\''.
+
+    QMEX_TARGET("sse2")
+    Word ClassifySSE2(const char* p, std::size_t n) noexcept
+    {
+        if (n < WORD_BITS) return ClassifyScalar(p, n);
+        const __m128i low = _mm_set1_epi8('\'');
+        const __m128i eq = _mm_set1_epi8('=');
+        const __m128i tick = _mm_set1_epi8('`');
+        Word m = 0;
+        for (int k = 0; k < WORD_BITS; k += 16)
+        {
+            const __m128i x = _mm_loadu_si128((const __m128i*)(p + k));
+            __m128i c = _mm_cmpeq_epi8(_mm_min_epu8(x, low), x);
+            c = _mm_or_si128(c, _mm_cmpeq_epi8(x, eq));
+            c = _mm_or_si128(c, _mm_cmpeq_epi8(x, tick));
+            m |= (Word)(unsigned)_mm_movemask_epi8(c) << k;
+        }
+        return m;
+    }
+
+    QMEX_TARGET("avx2")
+    Word ClassifyAVX2(const char* p, std::size_t n) noexcept
+    {
+        if (n < WORD_BITS) return ClassifyScalar(p, n);
+        const __m256i low = _mm256_set1_epi8('\'');
+        const __m256i eq = _mm256_set1_epi8('=');
+        const __m256i tick = _mm256_set1_epi8('`');
+        Word m = 0;
+        for (int k = 0; k < WORD_BITS; k += 32)
+        {
+            const __m256i x = _mm256_loadu_si256((const __m256i*)(p + k));
+            __m256i c = _mm256_cmpeq_epi8(_mm256_min_epu8(x, low), x);
+            c = _mm256_or_si256(c, _mm256_cmpeq_epi8(x, eq));
+            c = _mm256_or_si256(c, _mm256_cmpeq_epi8(x, tick));
+            m |= (Word)(unsigned)_mm256_movemask_epi8(c) << k;
+        }
+        return m;
+    }
+
+    bool HasSSE2() noexcept
+    {
+#if defined(_MSC_VER) && !defined(__clang__)
+        int info[4];
+        __cpuid(info, 1);
+        return (info[3] & (1 << 26)) != 0;
+#else
+        return __builtin_cpu_supports("sse2") != 0;
+#endif
+    }
+#endif
+
+    /// Select the widest classifier supported by the running CPU, QMEX_SIMD caps it as for Kernel().
+    ClassifyKernel SelectClassifier() noexcept
+    {
+        const char* cap = std::getenv("QMEX_SIMD");
+        if (cap == nullptr) cap = "";
+#ifdef QMEX_X86
+        if (std::strcmp(cap, "scalar") && std::strcmp(cap, "sse4.1") && HasAVX2()) return &ClassifyAVX2;
+        if (std::strcmp(cap, "scalar") && HasSSE2()) return &ClassifySSE2;
+#endif
+        return &ClassifyScalar;
+    }
+
+    ClassifyKernel Classifier() noexcept
+    {
+        static const ClassifyKernel kernel = SelectClassifier();
+        return kernel;
+    }
+
+    /// Cell of a table text, quotes excluded.
+    struct View
+    {
+        std::size_t offset;
+        std::size_t length;
+    };
+
+    /// Split a table text into cells and validate its shape, the text is never modified.
+    /// Bytes are classified a block at a time, only the marked ones are stepped through.
+    struct Tokenizer
+    {
+        std::vector<View> cells;
+        int rows;
+        int cols;
+        int criteria;
+
+        Tokenizer() : rows(0), cols(0), criteria(0) {}
+
+        /// Tokenize buf[begin, end), which is terminated as if buf[end] were '\0'.
+        /// A chunk of a text must begin at a line, rows, cols and criteria are kept across chunks.
+        void tokenize(const char* buf, std::size_t begin, std::size_t end) noexcept(false)
+        {
+            lines = 1;
+            for (const char* p = buf + begin, *e = buf + end; p != e && (p = (const char*)std::memchr(p, '\n', e - p)); ++p)
+                ++lines;
+
+            j = 0;
+            split = 0;
+            cell = NoCell;
+            quote = '\0';
+
+            const ClassifyKernel classify = Classifier();
+            std::size_t i = begin; // bytes before i are stepped through
+            for (std::size_t base = begin; base < end; base += WORD_BITS)
+            {
+                const std::size_t n = (std::min)(end - base, (std::size_t)WORD_BITS);
+                for (Word m = classify(buf + base, n); m; m &= m - 1)
+                {
+                    const std::size_t k = base + Lowest(m);
+                    if (k > i && cell == NoCell) start(i);
+                    step(k, buf[k]);
+                    i = k + 1;
+                }
+            }
+            if (end > i && cell == NoCell) start(i);
+            step(end, '\0');
+        }
+
+    private:
+        enum : std::size_t { NoCell = ~std::size_t(0) };
+
+        std::size_t lines; // upper bound of rows
+        int j;             // cells of current row
+        int split;         // criteria of current row, 0 if no '=' yet
+        std::size_t cell;  // offset of current cell
+        char quote;        // of current cell
+
+        void start(std::size_t i) noexcept
+        {
+            cell = i;
+            ++j;
+        }
+
+        void step(std::size_t i, char c) noexcept(false)
+        {
+            switch (c)
+            {
+            case '\0':
+            case '\r':
+            case '\n':
+                if (j != 0)
+                {
+                    if (quote)
+                    {
+                        char str[200];
+                        snprintf(str, sizeof(str), "Table has non-enclosed quote %c at row %d", quote, rows);
+                        throw TableFormatError(str);
+                    }
+                    if (cols == 0)
+                    {
+                        cols = j;
+                        cells.reserve(lines * cols);
+                    }
+                    if (split == 0 || split == j)
+                    {
+                        char str[200];
+                        snprintf(str, sizeof(str), "Table has no data at row %d", rows);
+                        throw TableFormatError(str);
+                    }
+                    if (cols != j)
+                    {
+                        char str[200];
+                        snprintf(str, sizeof(str), "Table has %d columns but %d at row %d", cols, j, rows);
+                        throw TableFormatError(str);
+                    }
+                    ++rows;
+                    j = 0;
+                    split = 0;
+                }
+                goto end;
+            case ' ':
+            case '\t':
+            //case ',':
+            case '=':
+                if (quote) return;
+                if (c == '=' && split == 0)
+                {
+                    split = j;
+                    if (criteria == 0)
+                        criteria = j;
+                    if (criteria != j)
+                    {
+                        char str[200];
+                        snprintf(str, sizeof(str), "Table has %d criteria but %d at row %d", criteria, j, rows);
+                        throw TableFormatError(str);
+                    }
+                    else if (j == 0)
+                    {
+                        char str[200];
+                        snprintf(str, sizeof(str), "Table has no criteria at row %d", rows);
+                        throw TableFormatError(str);
+                    }
+                }
+            end:
+                if (cell != NoCell)
+                {
+                    if (quote)
+                    {
+                        ++cell;
+                        quote = '\0';
+                    }
+                    View v = { cell, i - cell };
+                    cells.push_back(v);
+                    cell = NoCell;
+                }
                 break;
+            case '\'':
+            case '"':
+            case '`':
+            case '!':
+            case '$':
+            case '%':
+                if (cell == NoCell) quote = c;
+                else if (quote == c) goto end;
+                //[[fallthrough]];
+            default:
+                if (cell == NoCell) // start a new cell
+                    start(i);
+            }
+        }
+    };
+
+    /// Tokenize buf[0, size) split at line breaks into chunks with up to threads threads.
+    /// Cells, shape and errors are identical to a single Tokenizer: the first chunk failing
+    /// or disagreeing with the rows before it is tokenized again after them to throw the error.
+    void Tokenize(Tokenizer& t, const char* buf, std::size_t size, unsigned threads) noexcept(false)
+    {
+        enum { MIN_CHUNK = 1 << 16 };
+        if (threads == 0) threads = (std::max)(1u, std::thread::hardware_concurrency());
+        const std::size_t n = (std::min)((std::size_t)threads, size / MIN_CHUNK);
+        std::vector<std::size_t> bounds(1, 0);
+        for (std::size_t k = 1; k < n; ++k)
+        {
+            const std::size_t b = (std::max)(bounds.back(), size / n * k);
+            const char* p = (const char*)std::memchr(buf + b, '\n', size - b);
+            if (p == nullptr) break;
+            if (p + 1 - buf > (std::ptrdiff_t)bounds.back()) bounds.push_back(p + 1 - buf);
+        }
+        bounds.push_back(size);
+        if (bounds.size() == 2) return t.tokenize(buf, 0, size);
+
+        std::vector<Tokenizer> chunks(bounds.size() - 1);
+        std::unique_ptr<bool[]> failed(new bool[chunks.size()]());
+        const auto run = [&](std::size_t k) noexcept
+        {
+            try { chunks[k].tokenize(buf, bounds[k], bounds[k + 1]); }
+            catch (...) { failed[k] = true; }
+        };
+
+        std::vector<std::thread> workers;
+        workers.reserve(chunks.size() - 1);
+        try
+        {
+            for (std::size_t k = 1; k < chunks.size(); ++k)
+                workers.push_back(std::thread(run, k));
+        }
+        catch (...)
+        {
+            for (std::size_t k = 1; k < chunks.size(); ++k)
+                failed[k] = true; // tokenized again below
+        }
+        run(0);
+        for (std::size_t k = 0; k < workers.size(); ++k)
+            workers[k].join();
+
+        std::size_t cells = 0;
+        for (std::size_t k = 0; k < chunks.size(); ++k)
+            cells += chunks[k].cells.size();
+        t.cells.reserve(cells);
+        for (std::size_t k = 0; k < chunks.size(); ++k)
+        {
+            Tokenizer& c = chunks[k];
+            if (failed[k] || (c.rows > 0 && t.rows > 0 && (c.cols != t.cols || c.criteria != t.criteria)))
+            {
+                Tokenizer r;
+                r.rows = t.rows;
+                r.cols = t.cols;
+                r.criteria = t.criteria;
+                r.tokenize(buf, bounds[k], bounds[k + 1]);
+                c.cells.swap(r.cells);
+                c.rows = r.rows - t.rows;
+                c.cols = r.cols;
+                c.criteria = r.criteria;
+            }
+            if (c.rows == 0) continue;
+            t.cells.insert(t.cells.end(), c.cells.begin(), c.cells.end());
+            t.rows += c.rows;
+            t.cols = c.cols;
+            t.criteria = c.criteria;
+        }
+    }
+
+    /// Read-only mapping of a whole file, or a private one if copy, whose pages are copied when written.
+    struct MappedFile
+    {
+        char* data;
+        std::size_t size;
+#ifdef _WIN32
+        HANDLE file;
+        HANDLE mapping;
+#endif
+
+        explicit MappedFile(const char* path, bool copy = false) noexcept(false) : data(nullptr), size(0)
+        {
+#ifdef _WIN32
+            file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (file == INVALID_HANDLE_VALUE) fail(path);
+            LARGE_INTEGER n;
+            if (!GetFileSizeEx(file, &n)) { CloseHandle(file); fail(path); }
+            size = (std::size_t)n.QuadPart;
+            mapping = size ? CreateFileMappingA(file, nullptr, copy ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, nullptr) : nullptr;
+            if (size && !mapping) { CloseHandle(file); fail(path); }
+            data = size ? (char*)MapViewOfFile(mapping, copy ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0) : nullptr;
+            if (size && !data) { CloseHandle(mapping); CloseHandle(file); fail(path); }
+#else
+            int fd = open(path, O_RDONLY);
+            if (fd < 0) fail(path);
+            struct stat st;
+            if (fstat(fd, &st) != 0) { close(fd); fail(path); }
+            size = (std::size_t)st.st_size;
+            void* p = size ? mmap(nullptr, size, copy ? PROT_READ | PROT_WRITE : PROT_READ,
+                                  copy ? MAP_PRIVATE : MAP_SHARED, fd, 0) : nullptr;
+            close(fd);
+            if (p == MAP_FAILED) fail(path);
+            data = (char*)p;
+#endif
+        }
+
+        ~MappedFile() noexcept
+        {
+#ifdef _WIN32
+            if (data) UnmapViewOfFile(data);
+            if (mapping) CloseHandle(mapping);
+            CloseHandle(file);
+#else
+            if (data) munmap(data, size);
+#endif
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        [[noreturn]] static void fail(const char* path) noexcept(false)
+        {
+            throw std::runtime_error(std::string("Failed to open file [") + path + ']');
+        }
+    };
+}
+
+namespace
+{
+    /// Header of a snapshot image written by Table::save, followed by arrays aligned to 8 bytes.
+    struct ImageHeader
+    {
+        char magic[8];
+        unsigned version;
+        unsigned layout;             // of types viewed in place, see Layout()
+        unsigned long long size;     // of the whole image
+        unsigned long long checksum; // of the bytes after the header
+        int rows;
+        int cols;
+        int criteria;
+        int ranges;
+    };
+
+    static_assert(sizeof(ImageHeader) % 8 == 0, "arrays after the header are aligned to 8 bytes");
+
+    const char ImageMagic[8] = { 'Q', 'M', 'E', 'X', 'S', 'N', 'A', 'P' };
+    enum { IMAGE_VERSION = 1 };
+
+    /// Byte order and sizes of the types viewed in place, images are only loaded by the same layout.
+    unsigned Layout() noexcept
+    {
+        const unsigned one = 1;
+        return (unsigned)sizeof(std::size_t) | (unsigned)sizeof(Glob) << 8 |
+               (unsigned)sizeof(IntervalTree::Node) << 16 | (unsigned)*(const unsigned char*)&one << 24;
+    }
+
+    unsigned long long Checksum(const char* p, std::size_t n) noexcept
+    {
+        unsigned long long h = 14695981039346656037ULL ^ n;
+        for (; n >= 8; p += 8, n -= 8)
+        {
+            unsigned long long w;
+            std::memcpy(&w, p, 8);
+            h = (h ^ w) * 1099511628211ULL;
+            h ^= h >> 31;
+        }
+        for (; n > 0; ++p, --n)
+            h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+        return h;
+    }
+
+    struct ImageWriter
+    {
+        std::string out;
+
+        void write(long long x)
+        {
+            out.append((const char*)&x, sizeof(x));
+        }
+
+        template<typename T>
+        void write(const Array<T>& a)
+        {
+            write((long long)a.size());
+            if (!a.empty()) out.append((const char*)a.data(), a.size() * sizeof(T));
+            out.resize((out.size() + 7) & ~(std::size_t)7, '\0');
+        }
+
+        void write(const RowIndex& x)
+        {
+            write(x.hashes);
+            write(x.keys);
+            write(x.offsets);
+            write(x.rows);
+            write(x.slots);
+        }
+    };
+
+    /// Arrays are viewed in place in the image.
+    struct ImageReader
+    {
+        const char* p;
+        const char* end;
+
+        [[noreturn]] static void fail() noexcept(false)
+        {
+            throw TableFormatError("Table snapshot is corrupted");
+        }
+
+        void read(long long& x) noexcept(false)
+        {
+            if (end - p < (std::ptrdiff_t)sizeof(x)) fail();
+            std::memcpy(&x, p, sizeof(x));
+            p += sizeof(x);
+        }
+
+        template<typename T>
+        void read(Array<T>& a) noexcept(false)
+        {
+            long long n;
+            read(n);
+            if (n < 0 || (unsigned long long)n > (std::size_t)(end - p) / sizeof(T)) fail();
+            const std::size_t size = ((std::size_t)n * sizeof(T) + 7) & ~(std::size_t)7;
+            if (size > (std::size_t)(end - p)) fail();
+            a.view((const T*)p, (std::size_t)n);
+            p += size;
+        }
+
+        void read(RowIndex& x) noexcept(false)
+        {
+            read(x.hashes);
+            read(x.keys);
+            read(x.offsets);
+            read(x.rows);
+            read(x.slots);
+        }
+    };
+}
+
+namespace
+{
+    /// Lua state evaluating the lua cells of a table, with an env and a cache of compiled chunks.
+    struct LuaState
+    {
+        lua_State* L;
+        LuaJIT* jit;
+        int cache; // > 0 for the user value of the userdata at index 1, < 0 for the registry reference
+        bool own;
+        bool init;
+        std::atomic<unsigned long long> hits;   // of memoized cells, read by other threads
+        std::atomic<unsigned long long> misses;
+
+        LuaState() noexcept : L(nullptr), jit(nullptr), cache(0), own(false), init(false), hits(0), misses(0) {}
+        ~LuaState() noexcept { clear(); }
+        LuaState(const LuaState&) = delete;
+        LuaState& operator=(const LuaState&) = delete;
+
+        void clear() noexcept
+        {
+            if (cache > 0)
+            {
+                lua_pushnil(L);
+                lua_setiuservalue(L, 1, cache);
+            }
+            else if (init && L)
+            {
+                luaL_unref(L, LUA_REGISTRYINDEX, -cache);
+                cache = 0;
+            }
+
+            if (own && L)
+            {
+                lua_close(L);
+            }
+
+            own = false;
+            init = false;
+            L = nullptr;
+            jit = nullptr;
+            hits = 0;
+            misses = 0;
+        }
+
+        int env() noexcept
+        {
+            if (cache > 0)
+            {
+                lua_getiuservalue(L, 1, cache);
+            }
+            else
+            {
+                lua_rawgeti(L, LUA_REGISTRYINDEX, -cache);
+            }
+            return lua_gettop(L);
+        }
+
+        lua_State* lua() noexcept
+        {
+            if (L == nullptr)
+            {
+                own = true;
+                L = luaL_newstate();
+                luaL_openlibs(L);
+            }
+            if (!init)
+            {
+                LuaStack s(L, 0);
+                lua_createtable(L, 0, 1); // env
+                lua_pushglobaltable(L);
+                lua_setfield(L, -2, "__index");
+                lua_pushvalue(L, -1);
+                lua_setmetatable(L, -2);
+
+                if (cache > 0)
+                {
+                    lua_setiuservalue(L, 1, cache);
+                }
+                else
+                {
+                    cache = -luaL_ref(L, LUA_REGISTRYINDEX);
+                }
+                init = true;
+            }
+            return L;
+        }
+    };
+
+    /// Key in env of the memos of {} cells, each keyed by the cell.
+    const char MemoKey = 0;
+
+    /// EvalLua, but the value is memoized with the values of the names the cell reads, and returned
+    /// without calling the chunk while they are unchanged. A memo is an array of the name count n,
+    /// the n names, their n values and the value of the cell. n < 0 if the cell is never memoized.
+    void MemoLua(LuaState& lua, int env, const char* expr, KeyValue& kv) noexcept(false)
+    {
+        lua_State* const L = lua.L;
+        LuaStack s(L, 2);
+        if (lua_rawgetp(L, env, &MemoKey) != LUA_TTABLE)
+        {
+            lua_pop(L, 1);
+            lua_createtable(L, 0, 0);
+            lua_pushvalue(L, -1);
+            lua_rawsetp(L, env, &MemoKey);
+        }
+        if (lua_rawgetp(L, -1, expr) != LUA_TTABLE)
+        {
+            lua_pop(L, 1);
+            std::vector<std::string> names;
+            const bool pure = PureNames(expr, names);
+            const int n = (int)names.size();
+            lua_createtable(L, 2 * n + 2, 0);
+            lua_pushinteger(L, pure ? n : -1);
+            lua_rawseti(L, -2, 1);
+            for (int k = 0; k < n; ++k)
+            {
+                lua_pushstring(L, names[k].c_str());
+                lua_rawseti(L, -2, 2 + k);
+            }
+            lua_pushvalue(L, -1);
+            lua_rawsetp(L, -3, expr);
+        }
+        const int memo = lua_gettop(L);
+
+        lua_rawgeti(L, memo, 1);
+        const int n = (int)lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        if (n < 0)
+        {
+            EvalLua(L, env, expr, kv);
+            return;
+        }
+
+        bool hit = lua_rawgeti(L, memo, 2 * n + 2) != LUA_TNIL;
+        ++s.n;
+        for (int k = 0; hit && k < n; ++k)
+        {
+            lua_rawgeti(L, memo, 2 + k);
+            lua_gettable(L, env);
+            lua_rawgeti(L, memo, 2 + n + k);
+            hit = lua_rawequal(L, -1, -2) != 0;
+            lua_pop(L, 2);
+        }
+        if (hit)
+        {
+            ++lua.hits;
+            LuaValue(L, env, kv);
+            return;
+        }
+        ++lua.misses;
+
+        // The value is dropped before the chunk is called, so a failed call leaves no stale value.
+        // Nor is it kept unless every name holds a number or string, or a C function such as tonumber,
+        // the text alone does not tell e.g. #t of a table or a global set to a lua function.
+        lua_pop(L, 1);
+        lua_pushnil(L);
+        lua_rawseti(L, memo, 2 * n + 2);
+        bool keep = true;
+        for (int k = 0; k < n; ++k)
+        {
+            lua_rawgeti(L, memo, 2 + k);
+            const int t = lua_gettable(L, env);
+            if (t != LUA_TNUMBER && t != LUA_TSTRING && !lua_iscfunction(L, -1)) keep = false;
+            lua_rawseti(L, memo, 2 + n + k);
+        }
+        LoadLua(L, env, expr, kv.key);
+        if (lua_pcall(L, 0, 1, 0))
+            throw LuaError(lua_tostring(L, -1));
+        ++s.n;
+        lua_geti(L, -1, 1);
+        LuaValue(L, env, kv);
+        if (!keep) return;
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, memo, 2 * n + 2);
+    }
+}
+
+struct Table::Context
+{
+    Array<std::size_t> cells; // offsets in text
+    Array<char> pool;         // text of cells if not parsed in place
+    const char* text;
+    std::unique_ptr<MappedFile> source; // text of cells if loaded in place from a file
+    std::unique_ptr<MappedFile> image;  // viewed by the arrays if loaded from a snapshot
+    std::vector<Column> columns;
+    std::vector<Range> ranges;
+    int rows;
+    int cols;
+    int criteria;
+    LuaState state; // of the table, pools have others
+    bool memoize;   // kept by clear
+
+    Context() noexcept : text(nullptr), memoize(false) {}
+    ~Context() noexcept { clear(); }
+
+    void clear() noexcept
+    {
+        cells.clear();
+        pool.clear();
+        text = nullptr;
+        columns.clear();
+        ranges.clear();
+        source.reset();
+        image.reset();
+        rows = 0;
+        cols = 0;
+        criteria = 0;
+        state.clear();
+    }
+
+    String cell(int i, int j) const noexcept { return text + cells[i * cols + j]; }
+
+    String at(int i, int j) const noexcept(false)
+    {
+        if (i < 0 || i >= rows || j < 0 || j >= cols)
+        {
+            char buf[200];
+            snprintf(buf, sizeof(buf), "index (%d,%d) out of range %dx%d", i, j, rows, cols);
+            throw std::out_of_range(buf);
+        }
+        return cell(i, j);
+    }
+
+    /// Decode and index the criteria columns of tokenized cells.
+    void compile(const Tokenizer& tokens) noexcept(false);
+    Column column(int j) const noexcept(false) { return column(j, nullptr, 0, 0, nullptr); }
+    /// Column j reusing the first head and last tail body rows of column j of old, whose cells are the same,
+    /// decoding the others and adding their count to decoded.
+    Column column(int j, const Context* old, int head, int tail, std::size_t* decoded) const noexcept(false);
+    /// Pair up range columns of the same key.
+    void group();
+    void index(Range& r) const;
+    /// Give the lua cells of next the compiled chunks of cells with the same text, keeping those of this version.
+    void share(const Context& next) noexcept;
+    /// Drop the compiled chunks of the lua cells of version, e.g. of a next version that failed to compile.
+    void drop(const Context& version) noexcept;
+    /// Move compiled chunks of lua cells to the cells of next with the same text, drop the others.
+    void migrate(const Context& next) noexcept;
+    void save(ImageWriter& w) const;
+    void restore(ImageReader& r, const ImageHeader& h) noexcept(false);
+
+    // Lua cells are evaluated in the state lua, the table itself is not modified.
+    /// Compile the lua cells into the chunk cache of env.
+    void precompile(LuaState& lua) const noexcept(false);
+    /// Compile the {} cells and dump a chunk for each distinct text, see Table::saveChunks.
+    void dumpChunks(LuaState& lua, std::string& out) const noexcept(false);
+    std::size_t loadChunks(LuaState& lua, const char* data, std::size_t size) const noexcept(false);
+    void verify(LuaState& lua, int row, KeyValue kvs[], std::size_t num, unsigned options) const noexcept(false);
+    void retrieve(LuaState& lua, int row, KeyValue kvs[], std::size_t num, unsigned options) const noexcept(false);
+    bool retrieve(LuaState& lua, int i, int j, KeyValue& kv) const noexcept(false);
+    /// Evaluate lua cell val into kv, with env at index env.
+    void evalCell(LuaState& lua, int env, String val, KeyValue& kv) const noexcept(false);
+    /// Last lua column of row matched by kvs, those of NIL values skipped unless nils, -1 if none.
+    int lastLua(int row, const KeyValue kvs[], std::size_t num, bool nils) const noexcept(false);
+    /// Plan of a row retrieve: reset env to kvs as setenv(kvs, num) then setenv(nullptr, 0), and evaluate the data
+    /// columns of row up to last into env in column order, so each is evaluated once and every lua cell sees the
+    /// columns before it. The cells of [] and the functions called by {} may read any of those columns.
+    void evaluateRow(LuaState& lua, int row, int last, const KeyValue kvs[], std::size_t num) const noexcept(false);
+    void setenv(LuaState& lua, const KeyValue kvs[], std::size_t num) const noexcept;
+    void getenv(LuaState& lua, KeyValue kvs[], std::size_t num, bool raw) const noexcept(false);
+    void global(LuaState& lua, const KeyValue kvs[], std::size_t num) const noexcept;
+};
+
+void Table::Context::compile(const Tokenizer& tokens) noexcept(false)
+{
+    rows = tokens.rows;
+    cols = tokens.cols;
+    criteria = tokens.criteria;
+    assert((int)cells.size() == rows * cols);
+    if (cells.empty()) throw TableFormatError("Table is empty");
+
+    columns.reserve(criteria);
+    for (int j = 0; j < criteria; ++j)
+        columns.push_back(column(j));
+    group();
+    for (std::size_t k = 0; k < ranges.size(); ++k)
+        index(ranges[k]);
+}
+
+Column Table::Context::column(int j, const Context* old, int head, int tail, std::size_t* decoded) const noexcept(false)
+{
+    int i = 0;
+    try
+    {
+        // Body row i is row i of old within the head, row i - shift of old within the tail.
+        const Column* o = old ? &old->columns[j] : nullptr;
+        const int shift = old ? rows - old->rows : 0;
+        const auto reused = [&](int i) { return o && (i <= head || i >= rows - tail); };
+        Column c(cell(0, j), j);
+        if (c.op == MH)
+        {
+            c.spans.reserve(rows);
+            c.globs.reserve(rows - 1);
+            for (i = 1; i < rows; ++i)
+            {
+                if (reused(i)) c.compile(i, *o, i <= head ? i : i - shift);
+                else c.compile(i, cell(i, j));
+            }
+            if (rows > 1) c.build(rows);
+        }
+        else
+        {
+            Criteria t(c);
+            c.numbers.resize(rows - 1);
+            for (i = 1; i < rows; ++i)
+            {
+                if (reused(i))
+                {
+                    c.numbers[i - 1] = o->numbers[(i <= head ? i : i - shift) - 1];
+                    continue;
+                }
+                t.bind(cell(i, j));
+                c.numbers[i - 1] = t.val.n.n;
+            }
+            if (c.op == EQ) c.build();
+        }
+        if (decoded) *decoded += rows - 1 - (o ? head + tail : 0);
+        return c;
+    }
+    catch (std::exception& e)
+    {
+        char buf[200];
+        snprintf(buf, sizeof(buf), "Table row:%d, col:%d\n", i, j + 1);
+        throw TableFormatError(std::string(buf) + e.what());
+    }
+}
+
+void Table::Context::group()
+{
+    for (int j = 0; j < (int)columns.size(); ++j)
+    {
+        const Column& c = columns[j];
+        const bool lower = c.op == GE || c.op == GT;
+        const bool upper = c.op == LE || c.op == LT;
+        if (!lower && !upper) continue;
+
+        std::size_t k = 0;
+        for (; k < ranges.size(); ++k)
+        {
+            const Range& r = ranges[k];
+            const Column& o = columns[r.lower >= 0 ? r.lower : r.upper];
+            if (o.len == c.len && std::strncmp(o.key, c.key, c.len) == 0) break;
+        }
+        if (k == ranges.size())
+        {
+            ranges.push_back(Range());
+            ranges.back().lower = -1;
+            ranges.back().upper = -1;
+        }
+
+        Range& r = ranges[k];
+        if (lower && r.lower < 0) r.lower = j;
+        if (upper && r.upper < 0) r.upper = j;
+    }
+}
+
+void Table::Context::index(Range& r) const
+{
+    r.tree = IntervalTree();
+    r.tree.lo.assign(rows - 1, (std::numeric_limits<long long>::min)());
+    r.tree.hi.assign(rows - 1, (std::numeric_limits<long long>::max)());
+    for (int i = 0; i < rows - 1; ++i)
+    {
+        if (r.lower >= 0)
+        {
+            const Column& c = columns[r.lower];
+            r.tree.lo[i] = c.numbers[i] + (c.op == GT ? 1LL : 0LL);
+        }
+        if (r.upper >= 0)
+        {
+            const Column& c = columns[r.upper];
+            r.tree.hi[i] = c.numbers[i] - (c.op == LT ? 1LL : 0LL);
+        }
+    }
+    r.tree.build();
+}
+
+void Table::Context::share(const Context& next) noexcept
+{
+    if (!state.init || state.L == nullptr) return; // no chunk compiled yet
+    lua_State* const L = state.L;
+
+    std::vector<String> exprs;
+    for (int i = 1; i < rows; ++i)
+        for (int j = criteria; j < cols; ++j)
+            if (cell(i, j)[0] == '{') exprs.push_back(cell(i, j));
+    const auto less = [](String a, String b) { return std::strcmp(a, b) < 0; };
+    std::sort(exprs.begin(), exprs.end(), less);
+
+    LuaStack s(L, 1);
+    const int e = state.env();
+    for (int i = 1; i < next.rows; ++i)
+    {
+        for (int j = next.criteria; j < next.cols; ++j)
+        {
+            String expr = next.cell(i, j);
+            if (expr[0] != '{') continue;
+            for (auto k = std::lower_bound(exprs.begin(), exprs.end(), expr, less);
+                 k != exprs.end() && std::strcmp(*k, expr) == 0; ++k)
+            {
+                if (lua_rawgetp(L, e, *k) == LUA_TFUNCTION)
+                {
+                    lua_rawsetp(L, e, expr); // the cells of next never alias those of this version
+                    break;
+                }
+                lua_pop(L, 1);
+            }
+        }
+    }
+}
+
+void Table::Context::drop(const Context& version) noexcept
+{
+    if (!state.init || state.L == nullptr) return;
+    lua_State* const L = state.L;
+
+    LuaStack s(L, 1);
+    const int e = state.env();
+    for (int i = 1; i < version.rows; ++i)
+    {
+        for (int j = version.criteria; j < version.cols; ++j)
+        {
+            if (version.cell(i, j)[0] != '{') continue;
+            lua_pushnil(L);
+            lua_rawsetp(L, e, version.cell(i, j));
+        }
+    }
+}
+
+void Table::Context::migrate(const Context& next) noexcept
+{
+    share(next);
+    drop(*this);
+    if (!state.init || state.L == nullptr) return;
+    LuaStack s(state.L, 1);
+    const int e = state.env();
+    lua_pushnil(state.L);
+    lua_rawsetp(state.L, e, &MemoKey); // memos are keyed by the cells of this version
+}
+
+void Table::Context::precompile(LuaState& lua) const noexcept(false)
+{
+    int i = 1, j = criteria;
+    try
+    {
+        for (; i < rows; ++i)
+        {
+            for (j = criteria; j < cols; ++j)
+            {
+                String val = cell(i, j);
+                if (val[0] == '{')
+                {
+                    LuaStack s(lua.lua(), 2);
+                    LoadLua(lua.L, lua.env(), val, cell(0, j));
+                }
+                else if (val[0] == '[')
+                {
+                    const std::size_t n = std::strlen(val);
+                    const std::string name(val + 1, n > 1 ? n - 2 : 0);
+                    LuaStack s(lua.lua(), 1);
+                    ResolveLua(lua.L, lua.env(), name.c_str(), cell(0, j), lua.jit);
+                }
+            }
+        }
+    }
+    catch (std::exception& e)
+    {
+        char buf[200];
+        snprintf(buf, sizeof(buf), "Table row:%d, col:%d[%s]\n", i, j + 1, cell(0, j));
+        throw TableFormatError(std::string(buf) + e.what());
+    }
+}
+
+Table::Table() noexcept : ctx(new Context) {}
+Table::~Table() noexcept { delete ctx; }
+void Table::clear() noexcept { ctx->clear(); }
+int Table::rows() const noexcept { return ctx->rows; }
+int Table::cols() const noexcept { return ctx->cols; }
+int Table::criteria() const noexcept { return ctx->criteria; }
+
+String Table::cell(int i, int j) const noexcept(false)
+{
+    return ctx->at(i, j);
+}
+
+void Table::print(FILE* f) const noexcept
+{
+    for (int i = 0; i < ctx->rows; ++i)
+    {
+        for (int j = 0; j < ctx->cols; ++j)
+        {
+            if (j == ctx->criteria)
+                std::fprintf(f, "%s ", "=");
+            std::fprintf(f, "%s ", cell(i, j));
+        }
+        std::fputc('\n', f);
+    }
+}
+
+void Table::parse(char* buf, std::size_t bufsz, lua_State* L, LuaJIT* jit) noexcept(false)
+{
+    parse(buf, bufsz, ParseOptions(), L, jit);
+}
+
+void Table::parse(char* buf, std::size_t bufsz, const ParseOptions& options, lua_State* L, LuaJIT* jit) noexcept(false)
+{
+    if (buf == nullptr || bufsz == 0 || buf[bufsz - 1] != '\0')
+        throw std::invalid_argument("invalid buffer input for table parse");
+
+    clear();
+    ctx->state.L = L;
+    ctx->state.jit = jit;
+
+    Tokenizer t;
+    Tokenize(t, buf, bufsz - 1, options.threads);
+    ctx->text = buf;
+    ctx->cells.reserve(t.cells.size());
+    for (std::size_t k = 0; k < t.cells.size(); ++k)
+    {
+        buf[t.cells[k].offset + t.cells[k].length] = '\0';
+        ctx->cells.push_back(t.cells[k].offset);
+    }
+    ctx->compile(t);
+    if (options.precompile) ctx->precompile(ctx->state);
+}
+
+void Table::load(const char* path, lua_State* L, LuaJIT* jit) noexcept(false)
+{
+    load(path, ParseOptions(), L, jit);
+}
+
+void Table::load(const char* path, const ParseOptions& options, lua_State* L, LuaJIT* jit) noexcept(false)
+{
+    if (path == nullptr)
+        throw std::invalid_argument("invalid path input for table load");
+
+    std::unique_ptr<MappedFile> file(new MappedFile(path, true));
+    clear();
+    ctx->state.L = L;
+    ctx->state.jit = jit;
+
+    Tokenizer t;
+    Tokenize(t, file->data, file->size, options.threads);
+    std::size_t size = 0, end = 0;
+    for (std::size_t k = 0; k < t.cells.size(); ++k)
+    {
+        size += t.cells[k].length + 1;
+        end = (std::max)(end, t.cells[k].offset + t.cells[k].length);
+    }
+
+    // Cells are terminated in place in the private mapping, so only the pages holding terminators are copied.
+    // A file ending with a cell has no room for its terminator and is copied to the pool instead.
+    if (end < file->size)
+    {
+        ctx->cells.reserve(t.cells.size());
+        for (std::size_t k = 0; k < t.cells.size(); ++k)
+        {
+            file->data[t.cells[k].offset + t.cells[k].length] = '\0';
+            ctx->cells.push_back(t.cells[k].offset);
+        }
+        ctx->text = file->data;
+        ctx->source.swap(file);
+        ctx->compile(t);
+        if (options.precompile) ctx->precompile(ctx->state);
+        return;
+    }
+
+    ctx->pool.resize(size);
+    ctx->cells.reserve(t.cells.size());
+    std::size_t offset = 0;
+    for (std::size_t k = 0; k < t.cells.size(); ++k)
+    {
+        char* cell = &ctx->pool[offset];
+        std::memcpy(cell, file->data + t.cells[k].offset, t.cells[k].length);
+        cell[t.cells[k].length] = '\0';
+        ctx->cells.push_back(offset);
+        offset += t.cells[k].length + 1;
+    }
+    ctx->text = ctx->pool.data();
+    ctx->compile(t);
+    if (options.precompile) ctx->precompile(ctx->state);
+}
+
+ReloadStats Table::reload(char* buf, std::size_t bufsz, const ParseOptions& options) noexcept(false)
+{
+    if (buf == nullptr || bufsz == 0 || buf[bufsz - 1] != '\0')
+        throw std::invalid_argument("invalid buffer input for table reload");
+
+    Tokenizer t;
+    Tokenize(t, buf, bufsz - 1, options.threads);
+    if (t.cells.empty()) throw TableFormatError("Table is empty");
+
+    Context next;
+    next.text = buf;
+    next.cells.reserve(t.cells.size());
+    for (std::size_t k = 0; k < t.cells.size(); ++k)
+    {
+        buf[t.cells[k].offset + t.cells[k].length] = '\0';
+        next.cells.push_back(t.cells[k].offset);
+    }
+    next.rows = t.rows;
+    next.cols = t.cols;
+    next.criteria = t.criteria;
+
+    // With the same header, the body rows of each criteria column are aligned by the leading and trailing cells
+    // equal in both versions. A column without changed cells is kept with its indexes, others reuse the decoded
+    // cells of the aligned rows, only decode the rest and are indexed again. All is rebuilt if the header changed.
+    ReloadStats stats = { 0, 0, 0, 0 };
+    bool same = ctx->cols == next.cols && ctx->criteria == next.criteria;
+    for (int j = 0; same && j < next.cols; ++j)
+        same = std::strcmp(ctx->cell(0, j), next.cell(0, j)) == 0;
+    std::vector<char> changed(next.criteria, 1);
+    std::vector<Column> built;
+    for (int j = 0; j < next.criteria; ++j)
+    {
+        if (!same)
+        {
+            built.push_back(next.column(j, nullptr, 0, 0, &stats.decoded));
+            ++stats.built;
+            continue;
+        }
+        const int body = (std::min)(ctx->rows, next.rows) - 1;
+        int head = 0, tail = 0;
+        while (head < body && std::strcmp(ctx->cell(head + 1, j), next.cell(head + 1, j)) == 0) ++head;
+        while (tail < body - head && std::strcmp(ctx->cell(ctx->rows - 1 - tail, j), next.cell(next.rows - 1 - tail, j)) == 0) ++tail;
+        changed[j] = ctx->rows != next.rows || head < body;
+        if (!changed[j])
+        {
+            ++stats.kept;
+            continue;
+        }
+        built.push_back(next.column(j, ctx, head, tail, &stats.decoded));
+        ++stats.spliced;
+    }
+
+    // Lua cells are compiled in the state of this version before anything is committed, unchanged ones reused.
+    if (options.precompile)
+    {
+        ctx->share(next);
+        try
+        {
+            next.precompile(ctx->state);
+        }
+        catch (...)
+        {
+            ctx->drop(next);
+            throw;
+        }
+    }
+
+    // Kept columns are lent to next for indexing and handed back on failure, so the table stays queryable.
+    next.columns.reserve(next.criteria);
+    try
+    {
+        for (int j = 0, k = 0; j < next.criteria; ++j)
+        {
+            next.columns.push_back(std::move(changed[j] ? built[k++] : ctx->columns[j]));
+            next.columns.back().key = next.cell(0, j);
+        }
+        if (same)
+        {
+            next.ranges.resize(ctx->ranges.size());
+            for (std::size_t k = 0; k < next.ranges.size(); ++k)
+            {
+                Range& r = next.ranges[k];
+                r.lower = ctx->ranges[k].lower;
+                r.upper = ctx->ranges[k].upper;
+                if ((r.lower >= 0 && changed[r.lower]) || (r.upper >= 0 && changed[r.upper]))
+                    next.index(r);
+            }
+        }
+        else
+        {
+            next.group();
+            for (std::size_t k = 0; k < next.ranges.size(); ++k)
+                next.index(next.ranges[k]);
+        }
+    }
+    catch (...)
+    {
+        for (std::size_t j = 0; j < next.columns.size(); ++j)
+        {
+            if (changed[j]) continue;
+            ctx->columns[j] = std::move(next.columns[j]);
+            ctx->columns[j].key = ctx->cell(0, (int)j);
+        }
+        ctx->drop(next);
+        throw;
+    }
+
+    for (std::size_t k = 0; same && k < next.ranges.size(); ++k)
+    {
+        Range& r = next.ranges[k];
+        if (!(r.lower >= 0 && changed[r.lower]) && !(r.upper >= 0 && changed[r.upper]))
+            r.tree = std::move(ctx->ranges[k].tree);
+    }
+
+    ctx->migrate(next);
+    if (std::find(changed.begin(), changed.end(), 0) == changed.end())
+        ctx->image.reset(); // no array views the snapshot
+    ctx->pool = Array<char>();
+    ctx->source.reset();
+    ctx->text = next.text;
+    ctx->cells = std::move(next.cells);
+    ctx->columns.swap(next.columns);
+    ctx->ranges.swap(next.ranges);
+    ctx->rows = next.rows;
+    ctx->cols = next.cols;
+    ctx->criteria = next.criteria;
+    return stats;
+}
+
+void Table::Context::save(ImageWriter& w) const
+{
+    Array<char> text;
+    Array<std::size_t> offsets;
+    offsets.reserve(cells.size());
+    for (std::size_t k = 0; k < cells.size(); ++k)
+    {
+        const char* cell = this->text + cells[k];
+        offsets.push_back(text.size());
+        text.append(cell, cell + std::strlen(cell) + 1);
+    }
+    w.write(text);
+    w.write(offsets);
+
+    for (std::size_t j = 0; j < columns.size(); ++j)
+    {
+        const Column& c = columns[j];
+        w.write(c.numbers);
+        w.write(c.globs);
+        w.write(c.spans);
+        w.write(c.pool);
+        w.write(c.literals);
+        w.write(c.values);
+        w.write(c.wild);
+    }
+
+    for (std::size_t k = 0; k < ranges.size(); ++k)
+    {
+        const Range& r = ranges[k];
+        w.write((long long)r.lower);
+        w.write((long long)r.upper);
+        w.write(r.tree.lo);
+        w.write(r.tree.hi);
+        w.write(r.tree.nodes);
+        w.write(r.tree.byLo);
+        w.write(r.tree.byHi);
+    }
+}
+
+void Table::Context::restore(ImageReader& r, const ImageHeader& h) noexcept(false)
+{
+    r.read(pool);
+    r.read(cells);
+    rows = h.rows;
+    cols = h.cols;
+    criteria = h.criteria;
+    if (rows <= 0 || cols <= criteria || criteria <= 0 || h.ranges < 0 || h.ranges > criteria ||
+        cells.size() != (std::size_t)rows * cols || pool.empty() || pool.back() != '\0')
+        ImageReader::fail();
+    text = pool.data();
+
+    for (std::size_t k = 0; k < cells.size(); ++k)
+        if (cells[k] >= pool.size()) ImageReader::fail();
+
+    const std::size_t body = (std::size_t)rows - 1;
+    columns.reserve(criteria);
+    for (int j = 0; j < criteria; ++j)
+    {
+        columns.push_back(Column(cell(0, j), j));
+        Column& c = columns.back();
+        r.read(c.numbers);
+        r.read(c.globs);
+        r.read(c.spans);
+        r.read(c.pool);
+        r.read(c.literals);
+        r.read(c.values);
+        r.read(c.wild);
+        if (!c.valid(body)) ImageReader::fail();
+    }
+
+    ranges.resize(h.ranges);
+    for (int k = 0; k < h.ranges; ++k)
+    {
+        Range& g = ranges[k];
+        long long lower, upper;
+        r.read(lower);
+        r.read(upper);
+        r.read(g.tree.lo);
+        r.read(g.tree.hi);
+        r.read(g.tree.nodes);
+        r.read(g.tree.byLo);
+        r.read(g.tree.byHi);
+        if (lower < -1 || lower >= criteria || upper < -1 || upper >= criteria || (lower < 0 && upper < 0) ||
+            (lower >= 0 && columns[lower].op != GE && columns[lower].op != GT) ||
+            (upper >= 0 && columns[upper].op != LE && columns[upper].op != LT) || !g.tree.valid(body))
+            ImageReader::fail();
+        g.lower = (int)lower;
+        g.upper = (int)upper;
+    }
+    if (r.p != r.end) ImageReader::fail();
+}
+
+void Table::save(const char* path) const noexcept(false)
+{
+    if (path == nullptr)
+        throw std::invalid_argument("invalid path input for table save");
+    if (ctx->rows == 0)
+        throw TableFormatError("Table is empty");
+
+    ImageHeader h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, ImageMagic, sizeof(h.magic));
+    h.version = IMAGE_VERSION;
+    h.layout = Layout();
+    h.rows = ctx->rows;
+    h.cols = ctx->cols;
+    h.criteria = ctx->criteria;
+    h.ranges = (int)ctx->ranges.size();
+
+    ImageWriter w;
+    w.out.assign(sizeof(h), '\0');
+    ctx->save(w);
+    h.size = w.out.size();
+    h.checksum = Checksum(&w.out[sizeof(h)], w.out.size() - sizeof(h));
+    std::memcpy(&w.out[0], &h, sizeof(h));
+
+    FILE* f = std::fopen(path, "wb");
+    const bool ok = f && std::fwrite(w.out.data(), 1, w.out.size(), f) == w.out.size();
+    if ((f && std::fclose(f) != 0) || !ok)
+        throw std::runtime_error(std::string("Failed to write file [") + path + ']');
+}
+
+void Table::loadCompiled(const char* path, lua_State* L, LuaJIT* jit) noexcept(false)
+{
+    if (path == nullptr)
+        throw std::invalid_argument("invalid path input for table load");
+
+    std::unique_ptr<MappedFile> file(new MappedFile(path));
+    ImageHeader h;
+    if (file->size < sizeof(h))
+        throw TableFormatError("Table snapshot is corrupted");
+    std::memcpy(&h, file->data, sizeof(h));
+    if (std::memcmp(h.magic, ImageMagic, sizeof(h.magic)) != 0)
+        throw TableFormatError("Table snapshot has no QMEX signature");
+    if (h.version != IMAGE_VERSION || h.layout != Layout())
+    {
+        char buf[200];
+        snprintf(buf, sizeof(buf), "Table snapshot version %u layout %08x is not %u layout %08x",
+                 h.version, h.layout, (unsigned)IMAGE_VERSION, Layout());
+        throw TableFormatError(buf);
+    }
+    if (h.size != file->size || h.checksum != Checksum(file->data + sizeof(h), file->size - sizeof(h)))
+        throw TableFormatError("Table snapshot is corrupted");
+
+    clear();
+    ctx->state.L = L;
+    ctx->state.jit = jit;
+    ImageReader r = { file->data + sizeof(h), file->data + file->size };
+    ctx->image.swap(file);
+    try
+    {
+        ctx->restore(r, h);
+    }
+    catch (...)
+    {
+        clear();
+        throw;
+    }
+}
+
+void Table::precompile() noexcept(false)
+{
+    ctx->precompile(ctx->state);
+}
+
+void Table::memoize(bool enable) noexcept
+{
+    ctx->memoize = enable;
+}
+
+MemoStats Table::memoStats() const noexcept
+{
+    MemoStats m = { ctx->state.hits, ctx->state.misses };
+    return m;
+}
+
+namespace
+{
+    /// Header of a chunk cache written by Table::saveChunks, followed by count entries aligned to 8 bytes,
+    /// each the hash of a cell text, the text with its '\0' and the chunk of the cell dumped by lua_dump.
+    /// Entries are sorted by hash then text, and a chunk is only given to a cell of the same text.
+    struct ChunkHeader
+    {
+        char magic[8];
+        unsigned version;
+        unsigned lua;                // LUA_VERSION_NUM of the dumped chunks
+        unsigned long long size;     // of the whole cache
+        unsigned long long checksum; // of the bytes after the header
+        long long count;
+    };
+
+    static_assert(sizeof(ChunkHeader) % 8 == 0, "entries after the header are aligned to 8 bytes");
+
+    const char ChunkMagic[8] = { 'Q', 'M', 'E', 'X', 'L', 'U', 'A', 'C' };
+    enum { CHUNK_VERSION = 2 };
+
+    int DumpChunk(lua_State*, const void* p, size_t size, void* ud) noexcept
+    {
+        static_cast<std::string*>(ud)->append(static_cast<const char*>(p), size);
+        return 0;
+    }
+
+    struct LuaChunk
+    {
+        const char* p;
+        std::size_t n;
+
+        static const char* read(lua_State*, void* ud, size_t* size) noexcept
+        {
+            LuaChunk* t = static_cast<LuaChunk*>(ud);
+            *size = t->n;
+            t->n = 0;
+            return *size ? t->p : nullptr;
+        }
+    };
+
+    /// Entry of a chunk cache, ordered by hash then text.
+    struct ChunkEntry
+    {
+        unsigned long long hash;
+        const char* text;
+        LuaChunk chunk;
+
+        bool operator<(const ChunkEntry& b) const noexcept
+        {
+            return hash != b.hash ? hash < b.hash : std::strcmp(text, b.text) < 0;
+        }
+    };
+}
+
+void Table::Context::dumpChunks(LuaState& lua, std::string& out) const noexcept(false)
+{
+    // Cells of the same text are dumped once.
+    std::vector<std::pair<ChunkEntry, int> > exprs;
+    for (int i = 1; i < rows; ++i)
+    {
+        for (int j = criteria; j < cols; ++j)
+        {
+            String val = cell(i, j);
+            if (val[0] != '{') continue;
+            const ChunkEntry x = { Checksum(val, std::strlen(val)), val, { nullptr, 0 } };
+            exprs.push_back(std::make_pair(x, i * cols + j));
+        }
+    }
+    std::sort(exprs.begin(), exprs.end(), [](const std::pair<ChunkEntry, int>& a, const std::pair<ChunkEntry, int>& b) {
+        return a.first < b.first;
+    });
+
+    ChunkHeader h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, ChunkMagic, sizeof(h.magic));
+    h.version = CHUNK_VERSION;
+    h.lua = LUA_VERSION_NUM;
+
+    ImageWriter w;
+    w.out.assign(sizeof(h), '\0');
+    if (!exprs.empty())
+    {
+        lua_State* L = lua.lua();
+        LuaStack s(L, 1);
+        const int e = lua.env();
+        for (std::size_t k = 0; k < exprs.size(); ++k)
+        {
+            if (k > 0 && !(exprs[k - 1].first < exprs[k].first)) continue;
+            const int i = exprs[k].second / cols;
+            const int j = exprs[k].second % cols;
+            LuaStack c(L, 1);
+            try
+            {
+                LoadLua(L, e, cell(i, j), cell(0, j));
+            }
+            catch (std::exception& ex)
+            {
+                char buf[200];
+                snprintf(buf, sizeof(buf), "Table row:%d, col:%d[%s]\n", i, j + 1, cell(0, j));
+                throw TableFormatError(std::string(buf) + ex.what());
+            }
+
+            Array<char> text;
+            text.append(exprs[k].first.text, exprs[k].first.text + std::strlen(exprs[k].first.text) + 1);
+            w.write((long long)exprs[k].first.hash);
+            w.write(text);
+            const std::size_t at = w.out.size();
+            w.write(0LL);
+            lua_dump(L, &DumpChunk, &w.out, 0);
+            const long long size = (long long)(w.out.size() - at - sizeof(long long));
+            std::memcpy(&w.out[at], &size, sizeof(size));
+            w.out.resize((w.out.size() + 7) & ~(std::size_t)7, '\0');
+            ++h.count;
+        }
+    }
+    h.size = w.out.size();
+    h.checksum = Checksum(&w.out[sizeof(h)], w.out.size() - sizeof(h));
+    std::memcpy(&w.out[0], &h, sizeof(h));
+    out.swap(w.out);
+}
+
+std::size_t Table::Context::loadChunks(LuaState& lua, const char* data, std::size_t size) const noexcept(false)
+{
+    ChunkHeader h;
+    if (size < sizeof(h))
+        throw TableFormatError("Table chunk cache is corrupted");
+    std::memcpy(&h, data, sizeof(h));
+    if (std::memcmp(h.magic, ChunkMagic, sizeof(h.magic)) != 0)
+        throw TableFormatError("Table chunk cache has no QMEX signature");
+    if (h.version != CHUNK_VERSION || h.lua != LUA_VERSION_NUM)
+        return 0; // cells are compiled from text as without a cache
+    if (h.size != size || h.count < 0 || h.checksum != Checksum(data + sizeof(h), size - sizeof(h)))
+        throw TableFormatError("Table chunk cache is corrupted");
+
+    std::vector<ChunkEntry> chunks;
+    chunks.reserve((std::size_t)h.count);
+    ImageReader r = { data + sizeof(h), data + size };
+    for (long long k = 0; k < h.count; ++k)
+    {
+        long long hash;
+        Array<char> text, code;
+        r.read(hash);
+        r.read(text);
+        r.read(code);
+        if (text.empty() || text.back() != '\0') ImageReader::fail();
+        const ChunkEntry x = { (unsigned long long)hash, text.data(), { code.data(), code.size() } };
+        chunks.push_back(x);
+    }
+    if (r.p != r.end) ImageReader::fail();
+    std::sort(chunks.begin(), chunks.end());
+
+    std::size_t n = 0;
+    if (chunks.empty()) return n;
+    lua_State* L = lua.lua();
+    LuaStack s(L, 2);
+    const int e = lua.env();
+    lua_createtable(L, (int)chunks.size(), 0); // loaded chunks shared by cells of the same text
+    const int loaded = lua_gettop(L);
+    for (int i = 1; i < rows; ++i)
+    {
+        for (int j = criteria; j < cols; ++j)
+        {
+            String val = cell(i, j);
+            if (val[0] != '{') continue;
+
+            LuaStack c(L, 1);
+            if (lua_rawgetp(L, e, val) == LUA_TFUNCTION) continue;
+            const ChunkEntry x = { Checksum(val, std::strlen(val)), val, { nullptr, 0 } };
+            auto k = std::lower_bound(chunks.begin(), chunks.end(), x);
+            if (k == chunks.end() || k->hash != x.hash || std::strcmp(k->text, val) != 0)
+                continue; // a stale entry or another text of the same hash
+
+            const int index = (int)(k - chunks.begin()) + 1;
+            lua_pop(L, 1);
+            if (lua_rawgeti(L, loaded, index) != LUA_TFUNCTION)
+            {
+                lua_pop(L, 1);
+                LuaChunk t = k->chunk;
+                if (lua_load(L, &LuaChunk::read, &t, cell(0, j), "b"))
+                    continue; // dumped by an incompatible lua build, compiled from text on first use
+
+                lua_pushvalue(L, e);
+                lua_setupvalue(L, -2, 1);
+                lua_pushvalue(L, -1);
+                lua_rawseti(L, loaded, index);
+            }
+            lua_pushvalue(L, -1);
+            lua_rawsetp(L, e, val);
+            ++n;
+        }
+    }
+    return n;
+}
+
+void Table::saveChunks(const char* path) noexcept(false)
+{
+    if (path == nullptr)
+        throw std::invalid_argument("invalid path input for table saveChunks");
+
+    std::string out;
+    ctx->dumpChunks(ctx->state, out);
+    FILE* f = std::fopen(path, "wb");
+    const bool ok = f && std::fwrite(out.data(), 1, out.size(), f) == out.size();
+    if ((f && std::fclose(f) != 0) || !ok)
+        throw std::runtime_error(std::string("Failed to write file [") + path + ']');
+}
+
+std::size_t Table::loadChunks(const char* path) noexcept(false)
+{
+    if (path == nullptr)
+        throw std::invalid_argument("invalid path input for table loadChunks");
+
+    MappedFile file(path);
+    return ctx->loadChunks(ctx->state, file.data, file.size);
+}
+
+namespace
+{
+    struct QueryInfo : Criteria
+    {
+        const Column* column;
+        int index; // of matched kvs[]
+        QueryInfo(const Column& c, int index) : Criteria(c), column(&c), index(index) {}
+    };
+
+    /// Temporaries keep up to SLACK times their current need, at least MIN_KEEP elements.
+    enum { SLACK = 4, MIN_KEEP = 64 };
+
+    /// Release the capacity of v beyond need once it exceeds the slack, e.g. after one huge batch or table.
+    template<typename T>
+    void Trim(std::vector<T>& v, std::size_t need)
+    {
+        if (v.capacity() <= SLACK * (std::max)(need, (std::size_t)MIN_KEEP)) return;
+        if (v.size() > need) v.erase(v.begin() + need, v.end());
+        v.shrink_to_fit();
+    }
+
+    /// Intersection of rows marked by indexes, rows are valid only if any index applied.
+    struct Candidates
+    {
+        std::vector<Word> rows;
+        std::vector<Word> bits;
+        std::size_t words;
+        bool applied;
+
+        Candidates() : words(0), applied(false) {}
+
+        void reset(std::size_t words)
+        {
+            this->words = words;
+            applied = false;
+            Trim(rows, words);
+            Trim(bits, words);
+        }
+
+        Word* begin()
+        {
+            bits.assign(words, 0);
+            return &bits[0];
+        }
+
+        void commit()
+        {
+            if (!applied) rows.swap(bits), applied = true;
+            else for (std::size_t w = 0; w < words; ++w) rows[w] &= bits[w];
+        }
+    };
+
+    /// MH criteria of a query bound to a compiled column.
+    struct Pattern
+    {
+        const Column* column;
+        String s;
+        std::size_t n;
+    };
+
+    /// Row with minimum distance found so far, the lowest row wins on equal distances.
+    struct Best
+    {
+        Distance d;
+        int i;
+
+        Best() : d(NoMatch), i(0) {}
+
+        void merge(const Best& other) noexcept
+        {
+            if (other.d < d || (other.d == d && other.i < i)) *this = other;
+        }
+    };
+
+    /// A query bound to the compiled criteria of a table, scanned block by block for the minimum distance.
+    struct Search
+    {
+        enum { BLOCK = 256, SPARSE = 32 };
+
+        std::vector<QueryInfo> info;
+        std::vector<Term> terms;
+        std::vector<Pattern> patterns;
+        Candidates candidates;
+
+        /// Bind kvs to the criteria of a table with rows > 1, false if no criteria bound.
+        /// A search may be bound again, its vectors keep their capacity.
+        bool bind(const std::vector<Column>& columns, const std::vector<Range>& ranges, int rows,
+                  const KeyValue kvs[], std::size_t num, unsigned options) noexcept(false)
+        {
+            info.clear();
+            terms.clear();
+            patterns.clear();
+            candidates.reset((rows - 1 + WORD_BITS - 1) / WORD_BITS);
+            info.reserve(columns.size());
+            for (std::size_t j = 0; j < columns.size(); ++j)
+            {
+                const Column& c = columns[j];
+                std::size_t k = 0;
+                while (k < num && !MatchKey(c.key, c.len, kvs[k].key)) ++k;
+                if (k < num)
+                {
+                    QueryInfo q(c, (int)k);
+                    if (kvs[k].type == NUMBER) q.bind(kvs[k].val.n);
+                    else if (kvs[k].type == STRING) q.bind(kvs[k].val.s);
+                    else q.bind((String)nullptr);
+                    info.push_back(q);
+                }
+                else if (!(options & QUERY_SUBSET))
+                {
+                    throw TooFewKeys("Query requires Criteria [" + std::string(c.key, c.len) + ']');
+                }
+            }
+
+            if (!(options & QUERY_SUPERSET))
+            {
+                for (std::size_t k = 0; k < num; ++k)
+                {
+                    std::size_t j = 0;
+                    if (k < columns.size())
+                        while (j < info.size() && info[j].index != (int)k) ++j;
+                    if (k >= columns.size() || j == info.size())
+                        throw TooManyKeys('[' + std::string(kvs[k].key) + "] not Criteria");
+                }
             }
-            if (info[j].index == -1)
+
+            if (info.empty()) return false;
+
+            terms.reserve(info.size());
+            for (std::size_t j = 0; j < info.size(); ++j)
             {
-                info[j].index = -2; // no match found
-                if (!(options & QUERY_SUBSET))
+                const Column& c = *info[j].column;
+                if (c.op == MH)
+                {
+                    Pattern p = { &c, info[j].val.s, std::strlen(info[j].val.s) };
+                    patterns.push_back(p);
+                }
+                else
                 {
-                    std::string msg = "Query requires Criteria [" + std::string(info[j].key);
-                    msg.resize(msg.size() - 2);
-                    msg[msg.size() - 1] = ']';
-                    throw TooFewKeys(msg);
+                    Term t = { &c.numbers[0], info[j].val.n.n, c.op };
+                    terms.push_back(t);
                 }
             }
+
+            for (std::size_t j = 0; j < patterns.size(); ++j)
+            {
+                patterns[j].column->candidates(patterns[j].s, patterns[j].n, candidates.begin());
+                candidates.commit();
+            }
+            for (std::size_t j = 0; j < info.size(); ++j)
+            {
+                if (info[j].op != EQ) continue;
+                info[j].column->candidates(info[j].val.n.n, candidates.begin());
+                candidates.commit();
+            }
+            for (std::size_t k = 0; k < ranges.size(); ++k)
+            {
+                const Range& r = ranges[k];
+                const Column* c = &columns[r.lower >= 0 ? r.lower : r.upper];
+                std::size_t j = 0;
+                while (j < info.size() && info[j].column != c) ++j;
+                if (j == info.size()) continue;
+                r.tree.mark(info[j].val.n.n, candidates.begin());
+                candidates.commit();
+            }
+            return true;
         }
-        if (!(options & QUERY_SUPERSET))
+
+        /// Scan body rows [r, r + count) with count <= BLOCK, true if no better row can be found any more.
+        bool scan(int r, int count, Best& best) const noexcept
         {
-            options |= QUERY_SUPERSET;
+            Distance d[BLOCK];
+            const Term* const t = terms.empty() ? nullptr : &terms[0];
+            const Word* const mask = candidates.applied ? &candidates.rows[r / WORD_BITS] : nullptr;
+            if (mask)
+            {
+                int n = 0;
+                for (int w = 0; w < (count + WORD_BITS - 1) / WORD_BITS; ++w)
+                    n += Popcount(mask[w]);
+                if (n == 0) return false;
+                if (n > SPARSE) Kernel()(t, terms.size(), r, count, d);
+                else for (int w = 0; w < (count + WORD_BITS - 1) / WORD_BITS; ++w)
+                {
+                    for (Word m = mask[w]; m; m &= m - 1)
+                    {
+                        const int k = w * WORD_BITS + Lowest(m);
+                        ScanScalar(t, terms.size(), r + k, 1, &d[k]);
+                    }
+                }
+            }
+            else
+            {
+                Kernel()(t, terms.size(), r, count, d);
+            }
 
-            for (std::size_t j = 0; j < info.size(); ++j)
+            for (int k = 0; k < count; ++k)
             {
-                if (info[j].index < 0 || info[j].index >= (int)info.size())
-                    continue;
-                info[info[j].index].count += 1;
+                if (mask && !((mask[k / WORD_BITS] >> (k % WORD_BITS)) & 1)) continue;
+                if (d[k] >= best.d) continue;
+                const int i = r + k + 1;
+                for (std::size_t j = 0; j < patterns.size(); ++j)
+                {
+                    if (!patterns[j].column->match(i, patterns[j].s, patterns[j].n))
+                        goto next;
+                }
+                best.d = d[k];
+                best.i = i;
+                if (best.d == 0) // current row is the best match already
+                    return true;
+            next:
+                ;
+            }
+            return false;
+        }
+    };
+
+    /// Temporaries of queries reused by each thread, so a query allocates nothing once they are large enough.
+    /// They are trimmed to the current query, so a thread retains at most SLACK times the bitmaps of
+    /// the table it queries (a bit per row) and the searches of its batch, i.e. of recent work only.
+    struct Scratch
+    {
+        Search search;
+        std::vector<Search> searches;
+        std::vector<Best> best;
+        std::vector<std::size_t> active;
+
+        static Scratch& local()
+        {
+            static thread_local Scratch scratch;
+            return scratch;
+        }
+    };
+}
+
+int Table::query(const KeyValue kvs[], std::size_t num, unsigned options) const noexcept(false)
+{
+    if (ctx->rows <= 1) return 0;
+
+    Search& s = Scratch::local().search;
+    Best best;
+    if (!s.bind(ctx->columns, ctx->ranges, ctx->rows, kvs, num, options)) return 0;
+    for (int r = 0; r < ctx->rows - 1; r += Search::BLOCK)
+        if (s.scan(r, (std::min)((int)Search::BLOCK, ctx->rows - 1 - r), best)) break;
+    return best.i;
+}
+
+void Table::queryBatch(const KeyValue* const queries[], const std::size_t nums[], std::size_t count,
+                       int rows[], unsigned options) const noexcept(false)
+{
+    std::fill(rows, rows + count, 0);
+    if (ctx->rows <= 1) return;
+
+    Scratch& scratch = Scratch::local();
+    std::vector<Search>& searches = scratch.searches;
+    std::vector<Best>& best = scratch.best;
+    std::vector<std::size_t>& active = scratch.active;
+    Trim(searches, count);
+    Trim(best, count);
+    Trim(active, count);
+    if (searches.size() < count) searches.resize(count);
+    best.assign(count, Best());
+    active.clear();
+    for (std::size_t k = 0; k < count; ++k)
+        if (searches[k].bind(ctx->columns, ctx->ranges, ctx->rows, queries[k], nums[k], options))
+            active.push_back(k);
+
+    // Each block of rows is scanned by all queries while it is still in cache.
+    for (int r = 0; r < ctx->rows - 1 && !active.empty(); r += Search::BLOCK)
+    {
+        const int n = (std::min)((int)Search::BLOCK, ctx->rows - 1 - r);
+        std::size_t m = 0;
+        for (std::size_t k = 0; k < active.size(); ++k)
+            if (!searches[active[k]].scan(r, n, best[active[k]])) active[m++] = active[k];
+        active.resize(m);
+    }
+
+    for (std::size_t k = 0; k < count; ++k)
+        rows[k] = best[k].i;
+}
+
+struct Executor::Pool
+{
+    typedef std::function<void()> Task;
+
+    struct Queue
+    {
+        std::mutex m;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue> > queues; // one per worker, the last one for callers
+    std::vector<std::thread> workers;
+    std::mutex m;
+    std::condition_variable cv;
+    std::size_t epoch; // of task submissions
+    std::size_t next;
+    bool stop;
+
+    explicit Pool(unsigned threads) : epoch(0), next(0), stop(false)
+    {
+        for (unsigned i = 0; i <= threads; ++i)
+            queues.push_back(std::unique_ptr<Queue>(new Queue));
+        for (unsigned i = 0; i < threads; ++i)
+            workers.push_back(std::thread(&Pool::work, this, (std::size_t)i));
+    }
+
+    ~Pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stop = true;
+        }
+        cv.notify_all();
+        for (std::size_t i = 0; i < workers.size(); ++i)
+            workers[i].join();
+    }
+
+    /// Pop from the front of own queue, or steal from the back of others.
+    bool take(std::size_t self, Task& task)
+    {
+        for (std::size_t k = 0; k < queues.size(); ++k)
+        {
+            Queue& q = *queues[(self + k) % queues.size()];
+            std::lock_guard<std::mutex> lock(q.m);
+            if (q.tasks.empty()) continue;
+            if (k == 0)
+            {
+                task.swap(q.tasks.front());
+                q.tasks.pop_front();
+            }
+            else
+            {
+                task.swap(q.tasks.back());
+                q.tasks.pop_back();
             }
+            return true;
+        }
+        return false;
+    }
 
-            for (std::size_t j = 0; j < (std::min)(info.size() + 1, num); ++j)
+    void work(std::size_t self)
+    {
+        for (Task task; ; )
+        {
+            std::size_t seen;
             {
-                if ((j < info.size() && info[j].count == 0) || (j == info.size()))
-                    throw TooManyKeys('[' + std::string(kvs[j].key) + "] not Criteria");
+                std::lock_guard<std::mutex> lock(m);
+                if (stop) return;
+                seen = epoch;
             }
+            for (; take(self, task); task = nullptr)
+                task();
+            std::unique_lock<std::mutex> lock(m);
+            cv.wait(lock, [&]() { return stop || epoch != seen; });
         }
-        if (matched == 0)
+    }
+
+    /// Run fn(0) ... fn(n - 1) in parallel, the calling thread takes part as well.
+    void run(std::size_t n, const std::function<void(std::size_t)>& fn) noexcept(false)
+    {
+        std::size_t done = 0;
+        std::exception_ptr error;
+        std::size_t failed = n; // lowest index of failed tasks
+        std::mutex em;          // of done and the error
+        std::condition_variable finished;
+        std::size_t first;
+        {
+            std::lock_guard<std::mutex> lock(m);
+            first = next;
+            next += n;
+        }
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            Task task = [&, i]() {
+                try
+                {
+                    fn(i);
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(em);
+                    if (i < failed) failed = i, error = std::current_exception();
+                }
+                std::lock_guard<std::mutex> lock(em);
+                if (++done == n) finished.notify_all();
+            };
+            Queue& q = *queues[(first + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(q.m);
+            q.tasks.push_back(task);
+        }
+        {
+            std::lock_guard<std::mutex> lock(m);
+            ++epoch;
+        }
+        cv.notify_all();
+
+        // Help until the queues are drained, then sleep until the tasks taken by workers are done.
+        for (Task task; take(queues.size() - 1, task); task = nullptr)
+            task();
+        std::unique_lock<std::mutex> lock(em);
+        finished.wait(lock, [&]() { return done == n; });
+        if (error) std::rethrow_exception(error);
+    }
+};
+
+Executor::Executor(unsigned threads) noexcept(false)
+    : pool(new Pool((threads ? threads : (std::max)(1u, std::thread::hardware_concurrency())) - 1)) {}
+
+Executor::~Executor() noexcept { delete pool; }
+
+unsigned Executor::threads() const noexcept { return (unsigned)pool->workers.size() + 1; }
+
+void Executor::queryBatch(const Table& table, const KeyValue* const queries[], const std::size_t nums[],
+                          std::size_t count, int rows[], unsigned options) noexcept(false)
+{
+    const std::size_t chunk = 64;
+    pool->run((count + chunk - 1) / chunk, [&](std::size_t k) {
+        const std::size_t n = (std::min)(chunk, count - k * chunk);
+        table.queryBatch(queries + k * chunk, nums + k * chunk, n, rows + k * chunk, options);
+    });
+}
+
+int Executor::query(const Table& table, const KeyValue kvs[], std::size_t num, unsigned options) noexcept(false)
+{
+    const Table::Context* const ctx = table.ctx;
+    if (ctx->rows <= 1) return 0;
+
+    Search s;
+    if (!s.bind(ctx->columns, ctx->ranges, ctx->rows, kvs, num, options)) return 0;
+
+    const int body = ctx->rows - 1;
+    const int chunk = Search::BLOCK * 16;
+    const std::size_t n = (std::size_t)((body + chunk - 1) / chunk);
+    std::vector<Best> best(n);
+    std::atomic<int> zero((std::numeric_limits<int>::max)()); // lowest row with zero distance
+    pool->run(n, [&](std::size_t k) {
+        const int end = (std::min)(body, (int)k * chunk + chunk);
+        for (int r = (int)k * chunk; r < end && r < zero; r += Search::BLOCK)
+        {
+            if (!s.scan(r, (std::min)((int)Search::BLOCK, end - r), best[k])) continue;
+            for (int z = zero; best[k].i < z && !zero.compare_exchange_weak(z, best[k].i); ) {}
             break;
-        if (sum_d < min_d)
+        }
+    });
+
+    for (std::size_t k = 1; k < n; ++k)
+        best[0].merge(best[k]);
+    return best[0].i;
+}
+
+namespace
+{
+    /// Current and replaced versions of T, each slot with a count of the readers pinning it.
+    /// A reader counts itself in the current slot and retries if that is no longer current afterwards,
+    /// so it never reads a slot being replaced. A writer switches the current slot and retires the replaced
+    /// one, deleted at once if unpinned or else by its last reader, which signals a writer waiting to reuse it.
+    template<typename T>
+    struct Versioned
+    {
+        std::atomic<int> current;
+        std::atomic<unsigned> readers[2];
+        std::atomic<bool> retired[2];
+        std::atomic<T*> slots[2];
+        std::atomic<unsigned long long> published;
+        std::mutex writer;
+        std::mutex retire;
+        std::condition_variable released;
+
+        Versioned() noexcept : current(0), published(0)
         {
-            min_d = sum_d;
-            min_i = i;
-            if (min_d == 0) // current row is the best match already
-                break;
+            for (int i = 0; i < 2; ++i)
+            {
+                readers[i] = 0;
+                retired[i] = false;
+                slots[i] = nullptr;
+            }
+        }
+
+        ~Versioned() noexcept
+        {
+            delete slots[0].load();
+            delete slots[1].load();
+        }
+
+        int pin() noexcept
+        {
+            for (;;)
+            {
+                const int i = current;
+                ++readers[i];
+                if (current == i) return i;
+                unpin(i);
+            }
+        }
+
+        /// Retired is set before readers is checked by the writer and read after readers is released here,
+        /// so either side sees the other and the version is deleted exactly once.
+        void unpin(int i) noexcept
+        {
+            if (--readers[i] != 0 || !retired[i]) return;
+            std::lock_guard<std::mutex> lock(retire);
+            reclaim(i);
+        }
+
+        T* get(int i) const noexcept { return slots[i]; }
+
+        /// Called with writer locked. Only waits if the slot to reuse is still pinned since the previous publish.
+        void publish(std::unique_ptr<T> next) noexcept
+        {
+            const int i = current;
+            std::unique_lock<std::mutex> lock(retire);
+            released.wait(lock, [&] { return !retired[1 - i]; });
+            slots[1 - i] = next.release();
+            current = 1 - i;
+            ++published;
+            retired[i] = true;
+            reclaim(i);
+        }
+
+        /// Called with retire locked.
+        void reclaim(int i) noexcept
+        {
+            if (!retired[i] || readers[i] != 0) return;
+            delete slots[i].exchange(nullptr);
+            retired[i] = false;
+            released.notify_all();
         }
-    next:
-        ;
+    };
+
+    struct Version
+    {
+        std::vector<char> text;
+        Table table;
+    };
+
+    typedef std::vector<std::pair<std::string, TableHandle*> > Names;
+
+    bool NameLess(const Names::value_type& entry, const char* name) noexcept
+    {
+        return std::strcmp(entry.first.c_str(), name) < 0;
+    }
+}
+
+struct TableHandle::Versions : Versioned<Version> {};
+
+TableHandle::Pin::Pin(Pin&& other) noexcept
+    : versions(other.versions), slot(other.slot), table(other.table)
+{
+    other.versions = nullptr;
+    other.table = nullptr;
+}
+
+TableHandle::Pin::~Pin() noexcept
+{
+    if (versions) versions->unpin(slot);
+}
+
+TableHandle::TableHandle() noexcept(false) : versions(new Versions) {}
+
+TableHandle::~TableHandle() noexcept { delete versions; }
+
+TableHandle::Pin TableHandle::pin() const noexcept
+{
+    const int i = versions->pin();
+    Version* v = versions->get(i);
+    return Pin(versions, i, v ? &v->table : nullptr);
+}
+
+unsigned long long TableHandle::version() const noexcept
+{
+    return versions->published;
+}
+
+void TableHandle::parse(const char* buf, std::size_t bufsz, const ParseOptions& options, lua_State* L, LuaJIT* jit) noexcept(false)
+{
+    std::unique_ptr<Version> next(new Version);
+    next->text.assign(buf, buf + bufsz);
+    if (next->text.empty() || next->text.back() != '\0') next->text.push_back('\0');
+    next->table.parse(next->text.data(), next->text.size(), options, L, jit);
+    std::lock_guard<std::mutex> lock(versions->writer);
+    versions->publish(std::move(next));
+}
+
+void TableHandle::load(const char* path, const ParseOptions& options, lua_State* L, LuaJIT* jit) noexcept(false)
+{
+    std::unique_ptr<Version> next(new Version);
+    next->table.load(path, options, L, jit);
+    std::lock_guard<std::mutex> lock(versions->writer);
+    versions->publish(std::move(next));
+}
+
+void TableHandle::loadCompiled(const char* path, lua_State* L, LuaJIT* jit) noexcept(false)
+{
+    std::unique_ptr<Version> next(new Version);
+    next->table.loadCompiled(path, L, jit);
+    std::lock_guard<std::mutex> lock(versions->writer);
+    versions->publish(std::move(next));
+}
+
+struct TableRegistry::Entries : Versioned<Names>
+{
+    std::vector<std::unique_ptr<TableHandle> > handles;
+};
+
+TableRegistry::TableRegistry() noexcept(false) : entries(new Entries) {}
+
+TableRegistry::~TableRegistry() noexcept { delete entries; }
+
+TableHandle* TableRegistry::find(const char* name) const noexcept
+{
+    const int i = entries->pin();
+    TableHandle* handle = nullptr;
+    if (const Names* names = entries->get(i))
+    {
+        Names::const_iterator it = std::lower_bound(names->begin(), names->end(), name, NameLess);
+        if (it != names->end() && it->first == name) handle = it->second;
     }
-    return min_i;
+    entries->unpin(i);
+    return handle;
+}
+
+TableHandle& TableRegistry::handle(const char* name) noexcept(false)
+{
+    if (TableHandle* handle = find(name)) return *handle;
+
+    std::lock_guard<std::mutex> lock(entries->writer);
+    if (TableHandle* handle = find(name)) return *handle;
+
+    const Names* names = entries->get(entries->current);
+    std::unique_ptr<Names> next(names ? new Names(*names) : new Names);
+    entries->handles.reserve(entries->handles.size() + 1);
+    entries->handles.emplace_back(new TableHandle);
+    TableHandle* handle = entries->handles.back().get();
+    next->insert(std::lower_bound(next->begin(), next->end(), name, NameLess), Names::value_type(name, handle));
+    entries->publish(std::move(next));
+    return *handle;
 }
 
-void Table::verify(int row, KeyValue kvs[], std::size_t num, unsigned options) noexcept(false)
+void Table::Context::verify(LuaState& lua, int row, KeyValue kvs[], std::size_t num, unsigned options) const noexcept(false)
 {
-    bool lua = false;
+    const int last = lastLua(row, kvs, num, false);
+    if (last >= 0) evaluateRow(lua, row, last, kvs, num);
     for (std::size_t k = 0; k < num; ++k)
     {
         if ((options & QUERY_SUPERSET) && kvs[k].type == NIL) continue;
         bool matched = false;
-        for (int j = ctx->criteria; j < ctx->cols; ++j)
+        for (int j = criteria; j < cols; ++j)
         {
             if (std::strcmp(cell(0, j), kvs[k].key)) continue;
             matched = true;
             if (kvs[k].type == NIL) break;
 
-            if (!lua)
-            {
-                String val = cell(row, j);
-                lua = val[0] == '{' || val[0] == '[';
-                if (lua)
-                {
-                    setenv(kvs, num);
-                    setenv(nullptr, 0);
-                }
-            }
-
             KeyValue kv = kvs[k];
-            retrieve(row, j, kv);
+            retrieve(lua, row, j, kv);
             if (kv.type == NUMBER)
             {
                 if (kv.val.n != kvs[k].val.n)
@@ -929,28 +3714,19 @@ void Table::verify(int row, KeyValue kvs[], std::size_t num, unsigned options) n
     }
 }
 
-void Table::retrieve(int row, KeyValue kvs[], std::size_t num, unsigned options) noexcept(false)
+void Table::Context::retrieve(LuaState& lua, int row, KeyValue kvs[], std::size_t num, unsigned options) const noexcept(false)
 {
-    bool lua = false;
+    // Lua cells are evaluated once by the plan, then retrieved from env.
+    const int last = lastLua(row, kvs, num, true);
+    if (last >= 0) evaluateRow(lua, row, last, kvs, num);
     for (std::size_t k = 0; k < num; ++k)
     {
         bool matched = false;
-        for (int j = ctx->criteria; j < ctx->cols; ++j)
+        for (int j = criteria; j < cols; ++j)
         {
             if (std::strcmp(cell(0, j), kvs[k].key)) continue;
 
-            if (!lua)
-            {
-                String val = cell(row, j);
-                lua = val[0] == '{' || val[0] == '[';
-                if (lua)
-                {
-                    setenv(kvs, num);
-                    setenv(nullptr, 0);
-                }
-            }
-
-            retrieve(row, j, kvs[k]);
+            retrieve(lua, row, j, kvs[k]);
             matched = true;
             break;
         }
@@ -959,41 +3735,35 @@ void Table::retrieve(int row, KeyValue kvs[], std::size_t num, unsigned options)
     }
 }
 
-bool Table::retrieve(int i, int j, KeyValue& kv) noexcept(false) try
+bool Table::Context::retrieve(LuaState& lua, int i, int j, KeyValue& kv) const noexcept(false) try
 {
-    String val = cell(i, j);
+    String val = at(i, j);
 
-    bool lua = val[0] == '{' || val[0] == '[';
-    if (lua)
+    bool eval = val[0] == '{' || val[0] == '[';
+    if (eval)
     {
         {
-            LuaStack s(ctx->lua(), 2);
-            int env = ctx->env();
-            lua_pushstring(ctx->lua(), kv.key);
-            if (lua_rawget(ctx->lua(), env) != LUA_TNIL)
+            LuaStack s(lua.lua(), 2);
+            int env = lua.env();
+            lua_pushstring(lua.lua(), kv.key);
+            if (lua_rawget(lua.lua(), env) != LUA_TNIL)
             {
-                LuaValue(ctx->lua(), env, kv);
-                return lua;
+                LuaValue(lua.lua(), env, kv);
+                return eval;
             }
         }
-        for (int k = j - 1; k >= ctx->criteria; --k)
+        for (int k = j - 1; k >= criteria; --k)
         {
             KeyValue ks(cell(0, k));
-            if (retrieve(i, k, ks)) break;
-            else setenv(&ks, 1);
+            if (retrieve(lua, i, k, ks)) break;
+            else setenv(lua, &ks, 1);
         }
     }
 
-    if (val[0] == '{')
-    {
-        LuaStack s(ctx->lua(), 1);
-        EvalLua(ctx->lua(), ctx->env(), val, kv);
-    }
-    else if (val[0] == '[')
+    if (eval)
     {
-        StringGuard _(val + std::strlen(val) - 1);
-        LuaStack s(ctx->lua(), 1);
-        CallLua(ctx->lua(), ctx->env(), val + 1, kv, ctx->jit);
+        LuaStack s(lua.lua(), 1);
+        evalCell(lua, lua.env(), val, kv);
     }
     else if (kv.type == NUMBER)
     {
@@ -1005,8 +3775,8 @@ bool Table::retrieve(int i, int j, KeyValue& kv) noexcept(false) try
         kv.type = STRING;
     }
 
-    if (lua) setenv(&kv, 1);
-    return lua;
+    if (eval) setenv(lua, &kv, 1);
+    return eval;
 }
 catch (std::exception& e)
 {
@@ -1015,78 +3785,311 @@ catch (std::exception& e)
     throw TableDataError(std::string(buf) + e.what());
 }
 
-void Table::setenv(const KeyValue kvs[], std::size_t num) noexcept
+void Table::Context::evalCell(LuaState& lua, int env, String val, KeyValue& kv) const noexcept(false)
+{
+    if (val[0] == '{')
+    {
+        if (memoize) MemoLua(lua, env, val, kv);
+        else EvalLua(lua.L, env, val, kv);
+    }
+    else
+    {
+        // Cells may be in a read-only snapshot, so the name is copied without the brackets.
+        const std::size_t n = std::strlen(val);
+        const std::string name(val + 1, n > 1 ? n - 2 : 0);
+        CallLua(lua.L, env, name.c_str(), kv, lua.jit);
+    }
+}
+
+int Table::Context::lastLua(int row, const KeyValue kvs[], std::size_t num, bool nils) const noexcept(false)
+{
+    int last = -1;
+    for (std::size_t k = 0; k < num; ++k)
+    {
+        if (!nils && kvs[k].type == NIL) continue;
+        for (int j = criteria; j < cols; ++j)
+        {
+            if (std::strcmp(cell(0, j), kvs[k].key)) continue;
+            String val = at(row, j);
+            if ((val[0] == '{' || val[0] == '[') && j > last) last = j;
+            break;
+        }
+    }
+    return last;
+}
+
+void Table::Context::evaluateRow(LuaState& lua, int row, int last, const KeyValue kvs[], std::size_t num) const noexcept(false)
+{
+    lua_State* const L = lua.lua();
+    LuaStack s(L, 1);
+    const int env = lua.env();
+    for (std::size_t k = 0; k < num; ++k)
+    {
+        lua_pushstring(L, kvs[k].key);
+        PushValue(L, kvs[k]);
+        lua_rawset(L, env);
+    }
+    for (int j = criteria; j < cols; ++j)
+    {
+        lua_pushstring(L, cell(0, j));
+        lua_pushnil(L);
+        lua_rawset(L, env);
+    }
+
+    int j = criteria;
+    KeyValue kv(cell(0, j));
+    try
+    {
+        for (; j <= last; ++j)
+        {
+            String val = cell(row, j);
+            kv = KeyValue(cell(0, j));
+            if (val[0] == '{' || val[0] == '[')
+            {
+                evalCell(lua, env, val, kv);
+            }
+            else
+            {
+                kv.val.s = val;
+                kv.type = STRING;
+            }
+            lua_pushstring(L, kv.key);
+            PushValue(L, kv);
+            lua_rawset(L, env);
+        }
+    }
+    catch (std::exception& e)
+    {
+        char buf[200];
+        snprintf(buf, sizeof(buf), "Table row:%d, col:%d[%s]\n", row, j + 1, kv.key);
+        throw TableDataError(std::string(buf) + e.what());
+    }
+}
+
+void Table::Context::setenv(LuaState& lua, const KeyValue kvs[], std::size_t num) const noexcept
 {
-    LuaStack s(ctx->lua(), 1);
-    int env = ctx->env();
+    LuaStack s(lua.lua(), 1);
+    int env = lua.env();
  
     if (!kvs || !num)
     {
-        for (int j = ctx->criteria; j < ctx->cols; ++j)
+        for (int j = criteria; j < cols; ++j)
         {
-            lua_pushstring(ctx->lua(), cell(0, j));
-            lua_pushnil(ctx->lua());
-            lua_rawset(ctx->lua(), env);
+            lua_pushstring(lua.lua(), cell(0, j));
+            lua_pushnil(lua.lua());
+            lua_rawset(lua.lua(), env);
         }
         return;
     }
 
     for (std::size_t i = 0; i < num; ++i)
     {
-        lua_pushstring(ctx->lua(), kvs[i].key);
-        if (kvs[i].type == NUMBER)
-            lua_pushnumber(ctx->lua(), kvs[i].val.n);
-        else if (kvs[i].type == STRING)
-            lua_pushstring(ctx->lua(), kvs[i].val.s);
-        else
-            lua_pushnil(ctx->lua());
-        lua_rawset(ctx->lua(), env);
+        lua_pushstring(lua.lua(), kvs[i].key);
+        PushValue(lua.lua(), kvs[i]);
+        lua_rawset(lua.lua(), env);
     }
 }
 
-void Table::getenv(KeyValue kvs[], std::size_t num, bool raw) noexcept(false)
+void Table::Context::getenv(LuaState& lua, KeyValue kvs[], std::size_t num, bool raw) const noexcept(false)
 {
-    LuaStack s(ctx->lua(), 1);
-    int env = ctx->env();
+    LuaStack s(lua.lua(), 1);
+    int env = lua.env();
     for (std::size_t i = 0; i < num; ++i)
     {
-        LuaStack s(ctx->lua(), 1);
+        LuaStack s(lua.lua(), 1);
         if (raw)
         {
-            lua_pushstring(ctx->lua(), kvs[i].key);
-            lua_rawget(ctx->lua(), env);
+            lua_pushstring(lua.lua(), kvs[i].key);
+            lua_rawget(lua.lua(), env);
         }
         else
         {
-            lua_getfield(ctx->lua(), env, kvs[i].key);
+            lua_getfield(lua.lua(), env, kvs[i].key);
         }
-        LuaValue(ctx->lua(), env, kvs[i]);
+        LuaValue(lua.lua(), env, kvs[i]);
     }
 }
 
-void Table::global(const KeyValue kvs[], std::size_t num) noexcept
+void Table::Context::global(LuaState& lua, const KeyValue kvs[], std::size_t num) const noexcept
 {
     if (!kvs || !num)
     {
-        for (int j = ctx->criteria; j < ctx->cols; ++j)
+        for (int j = criteria; j < cols; ++j)
         {
             KeyValue kv(cell(0, j));
-            global(&kv, 1);
+            global(lua, &kv, 1);
         }
         return;
     }
     for (std::size_t i = 0; i < num; ++i)
     {
-        if (kvs[i].type == NUMBER)
-            lua_pushnumber(ctx->lua(), kvs[i].val.n);
-        else if (kvs[i].type == STRING)
-            lua_pushstring(ctx->lua(), kvs[i].val.s);
-        else
-            lua_pushnil(ctx->lua());
-        lua_setglobal(ctx->lua(), kvs[i].key);
+        PushValue(lua.lua(), kvs[i]);
+        lua_setglobal(lua.lua(), kvs[i].key);
+    }
+}
+
+
+void Table::verify(int row, KeyValue kvs[], std::size_t num, unsigned options) noexcept(false)
+{
+    ctx->verify(ctx->state, row, kvs, num, options);
+}
+
+void Table::retrieve(int row, KeyValue kvs[], std::size_t num, unsigned options) noexcept(false)
+{
+    ctx->retrieve(ctx->state, row, kvs, num, options);
+}
+
+bool Table::retrieve(int i, int j, KeyValue& kv) noexcept(false)
+{
+    return ctx->retrieve(ctx->state, i, j, kv);
+}
+
+void Table::setenv(const KeyValue kvs[], std::size_t num) noexcept
+{
+    ctx->setenv(ctx->state, kvs, num);
+}
+
+void Table::getenv(KeyValue kvs[], std::size_t num, bool raw) noexcept(false)
+{
+    ctx->getenv(ctx->state, kvs, num, raw);
+}
+
+void Table::global(const KeyValue kvs[], std::size_t num) noexcept
+{
+    ctx->global(ctx->state, kvs, num);
+}
+
+struct LuaStatePool::State : LuaState {};
+
+struct LuaStatePool::States
+{
+    const Table::Context& table;
+    const std::function<lua_State*()> open;
+    LuaJIT* const jit;
+    std::string image; // chunks of the table dumped by the first state
+    mutable std::mutex m;
+    std::vector<std::unique_ptr<State> > all;
+    std::vector<State*> idle;
+
+    States(const Table::Context& table, std::function<lua_State*()> open, LuaJIT* jit)
+        : table(table), open(std::move(open)), jit(jit) {}
+
+    std::unique_ptr<State> create() const noexcept(false)
+    {
+        std::unique_ptr<State> s(new State);
+        if (open)
+        {
+            s->L = open();
+            s->own = true;
+        }
+        s->jit = jit;
+        if (!image.empty()) table.loadChunks(*s, image.data(), image.size());
+        return s;
+    }
+};
+
+LuaStatePool::LuaStatePool(const Table& table, std::function<lua_State*()> open, LuaJIT* jit) noexcept(false)
+    : states(new States(*table.ctx, std::move(open), jit))
+{
+    try
+    {
+        std::unique_ptr<State> first = states->create();
+        states->table.dumpChunks(*first, states->image);
+        states->idle.push_back(first.get());
+        states->all.push_back(std::move(first));
+    }
+    catch (...)
+    {
+        delete states;
+        throw;
+    }
+}
+
+LuaStatePool::~LuaStatePool() noexcept { delete states; }
+
+LuaStatePool::Lease LuaStatePool::lease() noexcept(false)
+{
+    {
+        std::lock_guard<std::mutex> lock(states->m);
+        if (!states->idle.empty())
+        {
+            State* state = states->idle.back();
+            states->idle.pop_back();
+            return Lease(states, state);
+        }
+    }
+
+    // Loading the chunks may take a while, other threads keep leasing.
+    std::unique_ptr<State> state = states->create();
+    std::lock_guard<std::mutex> lock(states->m);
+    states->all.push_back(std::move(state));
+    return Lease(states, states->all.back().get());
+}
+
+std::size_t LuaStatePool::size() const noexcept
+{
+    std::lock_guard<std::mutex> lock(states->m);
+    return states->all.size();
+}
+
+MemoStats LuaStatePool::memoStats() const noexcept
+{
+    MemoStats m = { 0, 0 };
+    std::lock_guard<std::mutex> lock(states->m);
+    for (std::size_t k = 0; k < states->all.size(); ++k)
+    {
+        m.hits += states->all[k]->hits;
+        m.misses += states->all[k]->misses;
     }
+    return m;
+}
+
+LuaStatePool::Lease::Lease(Lease&& other) noexcept : states(other.states), state(other.state)
+{
+    other.state = nullptr;
+}
+
+LuaStatePool::Lease::~Lease() noexcept
+{
+    if (state == nullptr) return;
+    std::lock_guard<std::mutex> lock(states->m);
+    states->idle.push_back(state);
+}
+
+lua_State* LuaStatePool::Lease::lua() noexcept
+{
+    return state->lua();
 }
 
+void LuaStatePool::Lease::verify(int row, KeyValue kvs[], std::size_t num, unsigned options) noexcept(false)
+{
+    states->table.verify(*state, row, kvs, num, options);
+}
+
+void LuaStatePool::Lease::retrieve(int row, KeyValue kvs[], std::size_t num, unsigned options) noexcept(false)
+{
+    states->table.retrieve(*state, row, kvs, num, options);
+}
+
+bool LuaStatePool::Lease::retrieve(int i, int j, KeyValue& kv) noexcept(false)
+{
+    return states->table.retrieve(*state, i, j, kv);
+}
+
+void LuaStatePool::Lease::setenv(const KeyValue kvs[], std::size_t num) noexcept
+{
+    states->table.setenv(*state, kvs, num);
+}
+
+void LuaStatePool::Lease::getenv(KeyValue kvs[], std::size_t num, bool raw) noexcept(false)
+{
+    states->table.getenv(*state, kvs, num, raw);
+}
+
+void LuaStatePool::Lease::global(const KeyValue kvs[], std::size_t num) noexcept
+{
+    states->table.global(*state, kvs, num);
+}
 
 extern "C" int lua_getnuvalue_hint(lua_State* L, int idx, int b)
 {
@@ -1124,14 +4127,14 @@ namespace
     {
         LuaTable(lua_State* L, int cache)
         {
-            ctx->L = L;
-            ctx->cache = cache;
+            ctx->state.L = L;
+            ctx->state.cache = cache;
         }
 
         void pushenv() noexcept
         {
-            (void) ctx->lua();
-            (void) ctx->env();
+            (void) ctx->state.lua();
+            (void) ctx->state.env();
         }
 
         void jit(lua_State* L, int env, const char* name) override
@@ -1242,9 +4245,9 @@ namespace
         return 0;
     }
 
-    std::vector<KeyValue> tokvs(lua_State* L, int idx)
+    void tokvs(lua_State* L, int idx, std::vector<KeyValue>& kvs)
     {
-        std::vector<KeyValue> kvs;
+        kvs.clear();
         kvs.reserve((std::size_t)lua_rawlen(L, idx));
         lua_pushnil(L);
         while (lua_next(L, idx))
@@ -1276,9 +4279,35 @@ namespace
             }
             lua_pop(L, 1);
         }
+    }
+
+    std::vector<KeyValue> tokvs(lua_State* L, int idx)
+    {
+        std::vector<KeyValue> kvs;
+        tokvs(L, idx, kvs);
         return kvs;
     }
 
+    /// Key values of a binding in thread-local scratch, taken while in use,
+    /// so a binding called back from a lua cell gets a buffer of its own.
+    struct ScratchKvs
+    {
+        std::vector<KeyValue> kvs;
+
+        ScratchKvs() noexcept { kvs.swap(spare()); }
+        ~ScratchKvs() noexcept
+        {
+            Trim(kvs, kvs.size());
+            spare().swap(kvs);
+        }
+
+        static std::vector<KeyValue>& spare() noexcept
+        {
+            static thread_local std::vector<KeyValue> kvs;
+            return kvs;
+        }
+    };
+
     int rows(lua_State* L)
     {
         LuaTable* t = checktable(L);
@@ -1333,7 +4362,85 @@ namespace
         void* buf = lua_newuserdatauv(L, len + 1, 0);
         std::memcpy(buf, data, len + 1);
         lua_setiuservalue(L, 1, UV_BUF);
-        t->parse((char*)buf, len + 1, L, jit ? t : nullptr);
+        t->parse((char*)buf, len + 1, ParseOptions(1, lua_toboolean(L, 4) != 0), L, jit ? t : nullptr);
+        return 0;
+    }
+    catch (std::exception& e)
+    {
+        return luaL_error(L, "%s", e.what());
+    }
+
+    int load(lua_State* L) try
+    {
+        LuaTable* t = checktable(L);
+        const char* path = luaL_checkstring(L, 2);
+
+        const bool jit = lua_isnoneornil(L, 3) == 0;
+        lua_pushvalue(L, 3);
+        lua_setiuservalue(L, 1, UV_JIT);
+
+        lua_pushnil(L);
+        lua_setiuservalue(L, 1, UV_BUF);
+        t->load(path, ParseOptions(1, lua_toboolean(L, 4) != 0), L, jit ? t : nullptr);
+        return 0;
+    }
+    catch (std::exception& e)
+    {
+        return luaL_error(L, "%s", e.what());
+    }
+
+    int reload(lua_State* L) try
+    {
+        LuaTable* t = checktable(L);
+        std::size_t len  = 0;
+        const char* data = luaL_checklstring(L, 2, &len);
+
+        lua_getiuservalue(L, 1, UV_BUF); // keep the previous buffer alive while reloading
+        void* buf = lua_newuserdatauv(L, len + 1, 0);
+        std::memcpy(buf, data, len + 1);
+        t->reload((char*)buf, len + 1, ParseOptions(1, lua_toboolean(L, 3) != 0));
+        lua_setiuservalue(L, 1, UV_BUF);
+        return 0;
+    }
+    catch (std::exception& e)
+    {
+        return luaL_error(L, "%s", e.what());
+    }
+
+    int loadCompiled(lua_State* L) try
+    {
+        LuaTable* t = checktable(L);
+        const char* path = luaL_checkstring(L, 2);
+
+        const bool jit = lua_isnoneornil(L, 3) == 0;
+        lua_pushvalue(L, 3);
+        lua_setiuservalue(L, 1, UV_JIT);
+
+        lua_pushnil(L);
+        lua_setiuservalue(L, 1, UV_BUF);
+        t->loadCompiled(path, L, jit ? t : nullptr);
+        return 0;
+    }
+    catch (std::exception& e)
+    {
+        return luaL_error(L, "%s", e.what());
+    }
+
+    int save(lua_State* L) try
+    {
+        LuaTable* t = checktable(L);
+        t->save(luaL_checkstring(L, 2));
+        return 0;
+    }
+    catch (std::exception& e)
+    {
+        return luaL_error(L, "%s", e.what());
+    }
+
+    int saveChunks(lua_State* L) try
+    {
+        LuaTable* t = checktable(L);
+        t->saveChunks(luaL_checkstring(L, 2));
         return 0;
     }
     catch (std::exception& e)
@@ -1341,12 +4448,25 @@ namespace
         return luaL_error(L, "%s", e.what());
     }
 
+    int loadChunks(lua_State* L) try
+    {
+        LuaTable* t = checktable(L);
+        lua_pushinteger(L, (lua_Integer)t->loadChunks(luaL_checkstring(L, 2)));
+        return 1;
+    }
+    catch (std::exception& e)
+    {
+        return luaL_error(L, "%s", e.what());
+    }
+
     int query(lua_State* L) try
     {
         LuaTable* t = checktable(L);
         luaL_checktype(L, 2, LUA_TTABLE);
         unsigned options = (unsigned)luaL_optinteger(L, 3, QUERY_EXACTLY);
-        std::vector<KeyValue> kvs = tokvs(L, 2);
+        ScratchKvs scratch;
+        std::vector<KeyValue>& kvs = scratch.kvs;
+        tokvs(L, 2, kvs);
         int row = t->query(kvs.empty() ? nullptr : &kvs[0], kvs.size(), options);
         lua_pushinteger(L, row);
         return 1;
@@ -1356,13 +4476,55 @@ namespace
         return luaL_error(L, "%s", e.what());
     }
 
+    int queryBatch(lua_State* L) try
+    {
+        LuaTable* t = checktable(L);
+        luaL_checktype(L, 2, LUA_TTABLE);
+        unsigned options = (unsigned)luaL_optinteger(L, 3, QUERY_EXACTLY);
+        const std::size_t count = (std::size_t)lua_rawlen(L, 2);
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            if (lua_rawgeti(L, 2, (lua_Integer)i + 1) != LUA_TTABLE)
+                return luaL_error(L, "query [%d] is not a table", (int)i + 1);
+            lua_pop(L, 1);
+        }
+
+        std::vector<std::vector<KeyValue> > kvs(count);
+        std::vector<const KeyValue*> queries(count);
+        std::vector<std::size_t> nums(count);
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            // Strings of KeyValue are kept alive by the queries table.
+            lua_rawgeti(L, 2, (lua_Integer)i + 1);
+            kvs[i] = tokvs(L, lua_gettop(L));
+            lua_pop(L, 1);
+            queries[i] = kvs[i].empty() ? nullptr : &kvs[i][0];
+            nums[i] = kvs[i].size();
+        }
+        std::vector<int> rows(count);
+        if (count) t->queryBatch(&queries[0], &nums[0], count, &rows[0], options);
+        lua_createtable(L, (int)count, 0);
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            lua_pushinteger(L, rows[i]);
+            lua_rawseti(L, -2, (lua_Integer)i + 1);
+        }
+        return 1;
+    }
+    catch (std::exception& e)
+    {
+        return luaL_error(L, "%s", e.what());
+    }
+
     int verify(lua_State* L) try
     {
         LuaTable* t = checktable(L);
         int row = (int)luaL_checkinteger(L, 2);
         luaL_checktype(L, 3, LUA_TTABLE);
         unsigned options = (unsigned)luaL_optinteger(L, 4, QUERY_SUBSET);
-        std::vector<KeyValue> kvs = tokvs(L, 3);
+        ScratchKvs scratch;
+        std::vector<KeyValue>& kvs = scratch.kvs;
+        tokvs(L, 3, kvs);
         t->verify(row, kvs.empty() ? nullptr : &kvs[0], kvs.size(), options);
         return 0;
     }
@@ -1377,7 +4539,9 @@ namespace
         int row = (int)luaL_checkinteger(L, 2);
         luaL_checktype(L, 3, LUA_TTABLE);
         unsigned options = (unsigned)luaL_optinteger(L, 4, QUERY_SUBSET);
-        std::vector<KeyValue> kvs = tokvs(L, 3);
+        ScratchKvs scratch;
+        std::vector<KeyValue>& kvs = scratch.kvs;
+        tokvs(L, 3, kvs);
         t->retrieve(row, kvs.empty() ? nullptr : &kvs[0], kvs.size(), options);
 
         lua_pushnil(L);
@@ -1430,7 +4594,14 @@ extern "C" int luaopen_qmex(lua_State* L)
             {"cell", cell},
             {"env", env},
             {"parse", parse},
+            {"load", load},
+            {"reload", reload},
+            {"loadCompiled", loadCompiled},
+            {"save", save},
+            {"saveChunks", saveChunks},
+            {"loadChunks", loadChunks},
             {"query", query},
+            {"queryBatch", queryBatch},
             {"verify", verify},
             {"retrieve", retrieve},
             {nullptr, nullptr}
@@ -24,6 +24,7 @@
 #  define QMEX_API
 #endif
 
+#include <functional>
 #include <stdexcept>
 #include <string>
 #include <cstdio>
@@ -178,7 +179,7 @@ namespace qmex
         static double (max)() noexcept;
         static double (min)() noexcept;
 
-        double distance(const KeyValue& q) noexcept(false);
+        double distance(const KeyValue& q) const noexcept(false);
     };
 
     struct TableFormatError : std::logic_error
@@ -223,11 +224,40 @@ namespace qmex
         QUERY_SUPERSET = 2,
     };
 
+    struct ParseOptions
+    {
+        /// Tokenize large tables in chunks with up to threads threads, 0 for hardware concurrency.
+        unsigned threads;
+        /// Precompile the lua cells while parsing, so lua errors are thrown by parse rather than the first retrieve.
+        bool precompile;
+
+        explicit ParseOptions(unsigned threads = 1, bool precompile = false) noexcept
+            : threads(threads), precompile(precompile) {}
+    };
+
+    /// Evaluations of memoized {} cells, see Table::memoize.
+    struct MemoStats
+    {
+        unsigned long long hits;   // the memoized value returned
+        unsigned long long misses; // the cell evaluated
+    };
+
+    /// Criteria columns of a new version of a table, see Table::reload.
+    struct ReloadStats
+    {
+        int kept;            // no cell changed, kept with the indexes
+        int spliced;         // the cells of unchanged leading and trailing rows reused, the others decoded
+        int built;           // decoded whole, e.g. as the header changed
+        std::size_t decoded; // criteria cells decoded
+    };
+
     class QMEX_API Table
     {
     protected:
         struct Context;
         Context* const ctx;
+        friend class Executor;
+        friend class LuaStatePool;
 
     public:
         Table() noexcept;
@@ -242,7 +272,46 @@ namespace qmex
         String cell(int i, int j) const noexcept(false);
         void print(FILE* f) const noexcept;
         void parse(char* buf, std::size_t bufsz, lua_State* L = nullptr, LuaJIT* jit = nullptr) noexcept(false);
-        int query(const KeyValue kvs[], std::size_t num, unsigned options = QUERY_EXACTLY) noexcept(false);
+        void parse(char* buf, std::size_t bufsz, const ParseOptions& options, lua_State* L = nullptr, LuaJIT* jit = nullptr) noexcept(false);
+        /// Parse a table file through a private mapping kept by the table, the cells are terminated in place so
+        /// only the pages written are copied. A file not ending with a newline or space is copied into a pool.
+        void load(const char* path, lua_State* L = nullptr, LuaJIT* jit = nullptr) noexcept(false);
+        void load(const char* path, const ParseOptions& options, lua_State* L = nullptr, LuaJIT* jit = nullptr) noexcept(false);
+        /// Parse buf as a new version of the table. The lua state and the compiled chunks of unchanged lua cells
+        /// are kept, so are the criteria columns without changed cells. With the same header, other columns only
+        /// decode the cells between their unchanged leading and trailing rows, e.g. of rows added or edited.
+        /// The previous buffer may be released after. The table is unchanged if it throws, e.g. on a lua cell
+        /// failing to compile with options.precompile.
+        ReloadStats reload(char* buf, std::size_t bufsz, const ParseOptions& options = ParseOptions()) noexcept(false);
+        /// Write the table with its decoded and indexed criteria to a snapshot file.
+        void save(const char* path) const noexcept(false);
+        /// Map a snapshot written by save of the same qmex version and platform, nothing is parsed or copied.
+        void loadCompiled(const char* path, lua_State* L = nullptr, LuaJIT* jit = nullptr) noexcept(false);
+        /// Compile all {} cells and resolve or jit the functions of all [] cells now instead of on first retrieve.
+        void precompile() noexcept(false);
+        /// Memoize the value of each {} cell with the values of the names it reads, and return it without calling
+        /// the chunk while they are unchanged. Only cells calling nothing but pure functions of the math, string
+        /// and utf8 libraries, tonumber, tostring, type, select, ..., and reading no fields of other tables are
+        /// memoized, others, e.g. {math.random()}, {os.time()}, {cfg.rate*Average} or _ENV, are evaluated each time.
+        /// A value is only kept while every name read holds a number or string, or a C function it calls.
+        /// Kept by parse, load and reload, set it before retrieving from a LuaStatePool of the table.
+        void memoize(bool enable) noexcept;
+        /// Memoized evaluations in the lua state of the table since parsed.
+        MemoStats memoStats() const noexcept;
+        /// Write the compiled chunks of all {} cells to a cache file keyed by the cell text.
+        void saveChunks(const char* path) noexcept(false);
+        /// Give the {} cells of the same text the chunks of a cache written by saveChunks, so they are not compiled.
+        /// Return the number of cells given a chunk, 0 if the cache was written by another lua or cache version.
+        /// Lua does not verify bytecode, only load caches written by trusted processes.
+        std::size_t loadChunks(const char* path) noexcept(false);
+        /// Find the row with minimum distance to kvs, 0 if none matched.
+        /// Never modifies the table, so a parsed table can be queried concurrently.
+        /// Each thread keeps its temporaries for later queries, trimmed to a few times the current need.
+        int query(const KeyValue kvs[], std::size_t num, unsigned options = QUERY_EXACTLY) const noexcept(false);
+        /// Same as rows[k] = query(queries[k], nums[k], options) for each k < count,
+        /// but the table is scanned once for all queries.
+        void queryBatch(const KeyValue* const queries[], const std::size_t nums[], std::size_t count,
+                        int rows[], unsigned options = QUERY_EXACTLY) const noexcept(false);
         void verify(int row, KeyValue kvs[], std::size_t num, unsigned options = QUERY_SUBSET) noexcept(false);
         void retrieve(int row, KeyValue kvs[], std::size_t num, unsigned options = QUERY_SUBSET) noexcept(false);
         bool retrieve(int i, int j, KeyValue& kv) noexcept(false);
@@ -250,6 +319,146 @@ namespace qmex
         void getenv(KeyValue kvs[], std::size_t num, bool raw = false) noexcept(false);
         void global(const KeyValue kvs[], std::size_t num) noexcept;
     };
+
+    /// Thread pool running queries in parallel, idle threads steal tasks queued to busy ones.
+    /// Results are identical to the serial Table::query, the lowest row wins on equal distances.
+    class QMEX_API Executor
+    {
+        struct Pool;
+        Pool* const pool;
+
+    public:
+        /// Use threads - 1 workers besides the calling thread, 0 for hardware concurrency.
+        explicit Executor(unsigned threads = 0) noexcept(false);
+        ~Executor() noexcept;
+        Executor(const Executor&) = delete;
+        Executor& operator=(const Executor&) = delete;
+
+        unsigned threads() const noexcept;
+        /// Split a batch of queries among threads.
+        void queryBatch(const Table& table, const KeyValue* const queries[], const std::size_t nums[],
+                        std::size_t count, int rows[], unsigned options = QUERY_EXACTLY) noexcept(false);
+        /// Split the rows of a large table among threads.
+        int query(const Table& table, const KeyValue kvs[], std::size_t num,
+                  unsigned options = QUERY_EXACTLY) noexcept(false);
+    };
+
+    /// Latest version of a table. A new version is built aside and published atomically, readers keep
+    /// the version they pinned and never block. The replaced version is deleted by its last reader; publishing
+    /// only waits for that if the version before it is still pinned, so a thread pinning one version may publish
+    /// once but must not publish twice before unpinning it.
+    class QMEX_API TableHandle
+    {
+        struct Versions;
+        Versions* const versions;
+
+    public:
+        /// A version pinned while alive, empty if nothing published yet.
+        class QMEX_API Pin
+        {
+            friend class TableHandle;
+            Versions* versions;
+            int slot;
+            Table* table;
+            Pin(Versions* versions, int slot, Table* table) noexcept
+                : versions(versions), slot(slot), table(table) {}
+
+        public:
+            Pin(Pin&& other) noexcept;
+            ~Pin() noexcept;
+            Pin(const Pin&) = delete;
+            Pin& operator=(const Pin&) = delete;
+
+            /// Const members of the table may be used concurrently, others must be serialized by callers.
+            Table* get() const noexcept { return table; }
+            Table* operator->() const noexcept { return table; }
+            Table& operator*() const noexcept { return *table; }
+            explicit operator bool() const noexcept { return table != nullptr; }
+        };
+
+        TableHandle() noexcept(false);
+        ~TableHandle() noexcept;
+        TableHandle(const TableHandle&) = delete;
+        TableHandle& operator=(const TableHandle&) = delete;
+
+        Pin pin() const noexcept;
+        /// Number of versions published.
+        unsigned long long version() const noexcept;
+        /// Parse a copy of buf, which need not be null-terminated, as a new version. The current one is kept on errors.
+        void parse(const char* buf, std::size_t bufsz, const ParseOptions& options = ParseOptions(),
+                   lua_State* L = nullptr, LuaJIT* jit = nullptr) noexcept(false);
+        void load(const char* path, const ParseOptions& options = ParseOptions(),
+                  lua_State* L = nullptr, LuaJIT* jit = nullptr) noexcept(false);
+        void loadCompiled(const char* path, lua_State* L = nullptr, LuaJIT* jit = nullptr) noexcept(false);
+    };
+
+    /// Table handles by name, looking up never blocks.
+    class QMEX_API TableRegistry
+    {
+        struct Entries;
+        Entries* const entries;
+
+    public:
+        TableRegistry() noexcept(false);
+        ~TableRegistry() noexcept;
+        TableRegistry(const TableRegistry&) = delete;
+        TableRegistry& operator=(const TableRegistry&) = delete;
+
+        /// Handle of name, created on first use and living as long as the registry.
+        TableHandle& handle(const char* name) noexcept(false);
+        /// nullptr if no handle of name.
+        TableHandle* find(const char* name) const noexcept;
+    };
+
+    /// Lua states of a parsed table, each leased to one thread at a time, so lua cells are retrieved in parallel.
+    /// Every state has its own env and chunk cache, loaded from the chunks of the table compiled once by the pool.
+    /// The table must not be parsed again while the pool is alive, nor the pool destroyed while leased.
+    class QMEX_API LuaStatePool
+    {
+        struct States;
+        States* const states;
+
+    public:
+        struct State;
+
+        /// A state leased to the calling thread while alive, the same as the lua members of Table otherwise.
+        class QMEX_API Lease
+        {
+            friend class LuaStatePool;
+            States* states;
+            State* state;
+            Lease(States* states, State* state) noexcept : states(states), state(state) {}
+
+        public:
+            Lease(Lease&& other) noexcept;
+            ~Lease() noexcept;
+            Lease(const Lease&) = delete;
+            Lease& operator=(const Lease&) = delete;
+
+            lua_State* lua() noexcept;
+            void verify(int row, KeyValue kvs[], std::size_t num, unsigned options = QUERY_SUBSET) noexcept(false);
+            void retrieve(int row, KeyValue kvs[], std::size_t num, unsigned options = QUERY_SUBSET) noexcept(false);
+            bool retrieve(int i, int j, KeyValue& kv) noexcept(false);
+            void setenv(const KeyValue kvs[], std::size_t num) noexcept;
+            void getenv(KeyValue kvs[], std::size_t num, bool raw = false) noexcept(false);
+            void global(const KeyValue kvs[], std::size_t num) noexcept;
+        };
+
+        /// open creates each state, e.g. with the functions of [] cells, a state with the standard libraries if empty.
+        /// The states are closed by the pool. jit is called by the thread holding the lease.
+        explicit LuaStatePool(const Table& table, std::function<lua_State*()> open = nullptr,
+                              LuaJIT* jit = nullptr) noexcept(false);
+        ~LuaStatePool() noexcept;
+        LuaStatePool(const LuaStatePool&) = delete;
+        LuaStatePool& operator=(const LuaStatePool&) = delete;
+
+        /// An idle state, or a new one if all are leased.
+        Lease lease() noexcept(false);
+        /// Number of states created.
+        std::size_t size() const noexcept;
+        /// Memoized evaluations in all states, see Table::memoize.
+        MemoStats memoStats() const noexcept;
+    };
 }
 
 #endif
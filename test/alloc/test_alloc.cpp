@@ -0,0 +1,257 @@
+#include "catch.hpp"
+#include "demo_table.hpp"
+
+#include <qmex.hpp>
+#include <lua.hpp>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+// glibc lets malloc, calloc and realloc be replaced over its own entry points; sanitizers replace them already.
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+#define QMEX_TEST_COUNT_MALLOC
+extern "C"
+{
+    void* __libc_malloc(std::size_t size);
+    void* __libc_calloc(std::size_t num, std::size_t size);
+    void* __libc_realloc(void* p, std::size_t size);
+}
+#endif
+
+using namespace qmex;
+
+namespace
+{
+    // Allocations of a shared qmex on Windows are not seen, as the DLL keeps its own operator new.
+    std::atomic<bool> counting(false);
+    std::atomic<std::size_t> allocations(0);
+
+    /// realloc not counted.
+    void* Reallocate(void* p, std::size_t size) noexcept
+    {
+#ifdef QMEX_TEST_COUNT_MALLOC
+        return __libc_realloc(p, size);
+#else
+        return std::realloc(p, size);
+#endif
+    }
+
+    /// Count operator new calls, and malloc, calloc and realloc calls with glibc, while alive.
+    struct Counting
+    {
+        Counting() { allocations = 0; counting = true; }
+        ~Counting() { counting = false; }
+    };
+
+    /// demo.ini scaled up to rows, so queries go through the row indexes and the interval trees.
+    std::string ScaledDemo(int rows)
+    {
+        std::string s = "Grade.EQ  Subject.MH  Score.GE  Score.LT  Age.AE  =  Class  Average\n";
+        const char* const subjects[] = { "Math", "Math|Art", "Art*", "*ic", "Ph?sics", "[CM]hem*" };
+        for (int i = 0; i < rows; ++i)
+        {
+            const int lo = i % 10 * 10;
+            s += std::to_string(i % 7) + ' ' + subjects[i % 6] + ' ' + std::to_string(lo) + ' ' +
+                 std::to_string(lo + 10 + i % 3 * 10) + ' ' + std::to_string(i % 40) + " = C" +
+                 std::to_string(i) + ' ' + std::to_string(i % 100) + ".5\n";
+        }
+        return s;
+    }
+
+    /// Lua allocations are not counted, only those of qmex around the bindings.
+    void* LuaAlloc(void*, void* p, std::size_t, std::size_t size)
+    {
+        if (size) return Reallocate(p, size);
+        std::free(p);
+        return nullptr;
+    }
+}
+
+#ifdef QMEX_TEST_COUNT_MALLOC
+extern "C" void* malloc(std::size_t size) noexcept
+{
+    if (counting) ++allocations;
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(std::size_t num, std::size_t size) noexcept
+{
+    if (counting) ++allocations;
+    return __libc_calloc(num, size);
+}
+
+extern "C" void* realloc(void* p, std::size_t size) noexcept
+{
+    if (counting) ++allocations;
+    return __libc_realloc(p, size);
+}
+#endif
+
+void* operator new(std::size_t size)
+{
+    if (counting) ++allocations;
+    if (void* p = Reallocate(nullptr, size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    if (counting) ++allocations;
+    return Reallocate(nullptr, size ? size : 1);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t& tag) noexcept
+{
+    return operator new(size, tag);
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { std::free(p); }
+#ifdef __cpp_sized_deallocation
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+#endif
+
+TEST_CASE("Query Without Allocation")
+{
+    DemoTable small(demo);
+    DemoTable large(ScaledDemo(3000));
+    const char* const subjects[] = { "Math", "Art", "Artistic", "Music", "Physics", "Chemistry", "Bio" };
+
+    const unsigned options = QUERY_SUBSET | QUERY_SUPERSET; // the small table has no Age
+    std::vector<std::vector<KeyValue> > queries;
+    for (int q = 0; q < 2000; ++q)
+    {
+        std::vector<KeyValue> kvs;
+        kvs.push_back(KeyValue("Grade", q % 8));
+        kvs.push_back(KeyValue("Subject", subjects[q % 7]));
+        kvs.push_back(KeyValue("Score", q % 120));
+        if (q % 2) kvs.push_back(KeyValue("Age", q % 50));
+        queries.push_back(kvs);
+    }
+
+    std::vector<const KeyValue*> batch;
+    std::vector<std::size_t> nums;
+    for (std::size_t m = 0; m < queries.size(); ++m)
+    {
+        batch.push_back(&queries[m][0]);
+        nums.push_back(queries[m].size());
+    }
+    std::vector<int> rows(queries.size());
+
+    KeyValue data[] = { KeyValue("Class", (String)nullptr), KeyValue("Average", 0.0) };
+    data[0].type = STRING;
+
+    // Warm up the scratch of this thread.
+    for (std::size_t m = 0; m < queries.size(); ++m)
+    {
+        small.query(&queries[m][0], queries[m].size(), options);
+        large.query(&queries[m][0], queries[m].size(), options);
+    }
+    large.queryBatch(&batch[0], &nums[0], batch.size(), &rows[0], options);
+
+    int matched = 0;
+    std::size_t count = 0;
+    {
+        Counting c;
+        for (int round = 0; round < 2; ++round)
+        {
+            for (std::size_t m = 0; m < queries.size(); ++m)
+            {
+                DemoTable& t = m % 2 ? small : large;
+                const int row = t.query(&queries[m][0], queries[m].size(), options);
+                if (row <= 0) continue;
+                ++matched;
+                t.retrieve(row, data, 2);
+                t.verify(row, data, 2);
+            }
+        }
+        large.queryBatch(&batch[0], &nums[0], batch.size(), &rows[0], options);
+        count = allocations;
+    }
+    CHECK(matched > 1000);
+    CHECK(count == 0);
+
+    for (std::size_t m = 0; m < queries.size(); m += 97)
+        CHECK(rows[m] == large.query(&queries[m][0], queries[m].size(), options));
+}
+
+TEST_CASE("Distance Without Allocation")
+{
+    Criteria eq("Grade.EQ", "2");
+    Criteria ge("Score.GE", "60");
+    Criteria mh("Subject.MH", "Math|Art*|Ph?sics");
+    const KeyValue qs[] = { KeyValue("Grade", 2), KeyValue("Score", "75"), KeyValue("Subject", "Artistic") };
+
+    const double expected = eq.distance(qs[0]) + ge.distance(qs[1]) + mh.distance(qs[2]);
+    double d = 0;
+    std::size_t count = 0;
+    {
+        Counting c;
+        for (int k = 0; k < 1000; ++k)
+            d += eq.distance(qs[0]) + ge.distance(qs[1]) + mh.distance(qs[2]);
+        count = allocations;
+    }
+    CHECK(expected > 0);
+    CHECK(d == 1000 * expected);
+    CHECK(count == 0);
+}
+
+TEST_CASE("Lua Bindings Without Allocation", "[lua]")
+{
+    const std::string text = ScaledDemo(3000);
+    lua_State* L = lua_newstate(LuaAlloc, nullptr);
+    luaL_openlibs(L);
+    luaL_requiref(L, "qmex", luaopen_qmex, 1);
+    lua_pop(L, 1);
+    lua_pushlstring(L, text.data(), text.size());
+    lua_setglobal(L, "text");
+    const char* const script =
+        "t = qmex.Table()\n"
+        "t:parse(text)\n"
+        "function run(n)\n"
+        "    local matched = 0\n"
+        "    for q = 1, n do\n"
+        "        local row = t:query({ Grade = q % 7; Subject = 'Math'; Score = q % 100; Age = q % 40 }, qmex.QUERY_SUBSET)\n"
+        "        if row > 0 then\n"
+        "            local data = { 'Class', 'Average' }\n"
+        "            t:retrieve(row, data)\n"
+        "            t:verify(row, data)\n"
+        "            matched = matched + 1\n"
+        "        end\n"
+        "    end\n"
+        "    return matched\n"
+        "end\n";
+    REQUIRE(luaL_dostring(L, script) == LUA_OK);
+
+    // Warm up the scratch of this thread.
+    lua_getglobal(L, "run");
+    lua_pushinteger(L, 200);
+    REQUIRE(lua_pcall(L, 1, 1, 0) == LUA_OK);
+    lua_pop(L, 1);
+
+    lua_Integer matched = 0;
+    std::size_t count = 0;
+    {
+        Counting c;
+        lua_getglobal(L, "run");
+        lua_pushinteger(L, 2000);
+        const int status = lua_pcall(L, 1, 1, 0);
+        count = allocations;
+        REQUIRE(status == LUA_OK);
+        matched = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+    }
+    lua_close(L);
+    CHECK(matched > 100);
+    CHECK(count == 0);
+}
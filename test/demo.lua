@@ -94,6 +94,28 @@ query({ Grade=2; Subject="Art"; Score=100; }, { Class="A"; Average=95; "Weight",
 -- Query [6]
 query({ Grade=2; Subject="Art"; Score=50; }, { Class="C"; "Average", "Weight", })
 
+-- Batch Query
+local rows = t:queryBatch({ { Grade=2; Subject="Math"; Score=80; }, { Grade=1; Subject="Math"; Score=99; } })
+print("batch", rows[1], rows[2])
+assert(rows[1] == 4 and rows[2] == 1, "queryBatch mismatch")
+
+-- Load
+do
+    local u <close> = qmex.Table()
+    u:load("demo.ini")
+    assert(u:rows() == t:rows() and u:cols() == t:cols() and u:criteria() == t:criteria(), "load mismatch")
+    for i = 0, t:rows() - 1 do
+        for j = 0, t:cols() - 1 do
+            assert(u:cell(i, j) == t:cell(i, j), "load mismatch")
+        end
+    end
+    u:save("demo.qmx")
+    u:loadCompiled("demo.qmx")
+    os.remove("demo.qmx")
+    assert(u:rows() == t:rows() and u:cell(4, 1) == t:cell(4, 1), "snapshot mismatch")
+    assert(u:query({ Grade=2; Subject="Math"; Score=80; }) == 4, "snapshot mismatch")
+end
+
 
 
 
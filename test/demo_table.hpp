@@ -0,0 +1,33 @@
+#ifndef QMEX_TEST_DEMO_TABLE_HPP
+#define QMEX_TEST_DEMO_TABLE_HPP
+
+#include <qmex.hpp>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace
+{
+    const char demo[] =
+        "Grade.EQ  Subject.MH  Score.GE  Score.LT  =  Class  Average\n"
+        "  1        Math         60        inf     =  PASS    85.5  \n"
+        "  1        Math        -inf       60      =  FAIL    55    \n"
+        "  2        Math|Art     90        inf     =  A       95    \n"
+        "  2        Math|Art     60        90      =  B       80    \n"
+        "  2        Math|Art    -inf       60      =  C       55    \n";
+
+    /// Table parsed from a copy of s, the demo table by default.
+    struct DemoTable : qmex::Table
+    {
+        std::vector<char> buf;
+
+        explicit DemoTable(const char* s = demo) : buf(s, s + std::strlen(s) + 1)
+        {
+            parse(&buf[0], buf.size());
+        }
+
+        explicit DemoTable(const std::string& s) : DemoTable(s.c_str()) {}
+    };
+}
+
+#endif
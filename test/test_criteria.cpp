@@ -35,6 +35,13 @@ TEST_CASE("Criteria MH")
     CHECK(c.distance(KeyValue("A", "0X5")) == 0);
     CHECK(c.distance(KeyValue("A", "0X54")) == 0);
     CHECK(c.distance(KeyValue("A", "0X")) == (Criteria::max)());
+
+    Criteria r("A.MH", "x*|*Y|?z?|"); // read-only pattern is never modified
+    CHECK(r.distance(KeyValue("A", "Xa")) == 0);
+    CHECK(r.distance(KeyValue("A", "ay")) == 0);
+    CHECK(r.distance(KeyValue("A", "aZb")) == 0);
+    CHECK(r.distance(KeyValue("A", "")) == 0);
+    CHECK(r.distance(KeyValue("A", "ab")) == (Criteria::max)());
 }
 
 TEST_CASE("Criteria EQ")
@@ -0,0 +1,967 @@
+#include "catch.hpp"
+#include "demo_table.hpp"
+
+#include <qmex.hpp>
+#include <lua.hpp>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+using namespace qmex;
+
+TEST_CASE("Table Parse")
+{
+    DemoTable t;
+    CHECK(t.rows() == 6);
+    CHECK(t.cols() == 6);
+    CHECK(t.criteria() == 4);
+    CHECK(std::string(t.cell(0, 2)) == "Score.GE");
+    CHECK(std::string(t.cell(3, 1)) == "Math|Art");
+
+    CHECK_THROWS_AS(DemoTable("A.XX = B\n1 = 2\n"), TableFormatError);
+    CHECK_THROWS_AS(DemoTable("A.EQ = B\n1 2 = 2\n"), TableFormatError);
+    CHECK_THROWS_AS(DemoTable("A.EQ = B\n1 = 2\nx = 3\n"), TableFormatError);
+    CHECK_NOTHROW(DemoTable("A.MH = B\n1 = 2\nx = 3\n"));
+}
+
+TEST_CASE("Table Query")
+{
+    DemoTable t;
+
+    KeyValue q1[] = { KeyValue("Grade", 2), KeyValue("Subject", "Math"), KeyValue("Score", 80) };
+    CHECK(t.query(q1, 3) == 4);
+
+    KeyValue q2[] = { KeyValue("Score", 100), KeyValue("Subject", "art"), KeyValue("Grade", 2) };
+    CHECK(t.query(q2, 3) == 3);
+
+    KeyValue q3[] = { KeyValue("Grade", 1), KeyValue("Subject", "Art"), KeyValue("Score", 80) };
+    CHECK(t.query(q3, 3) == 0);
+
+    KeyValue q4[] = { KeyValue("Grade", "1"), KeyValue("Subject", "Math"), KeyValue("Score", "-inf") };
+    CHECK(t.query(q4, 3) == 2);
+
+    KeyValue q5[] = { KeyValue("Grade", 2), KeyValue("Subject", "Art") };
+    CHECK_THROWS_AS(t.query(q5, 2), TooFewKeys);
+    CHECK(t.query(q5, 2, QUERY_SUBSET) == 3);
+
+    KeyValue q6[] = { KeyValue("Grade", 2), KeyValue("Subject", "Art"), KeyValue("Score", 50), KeyValue("Age", 9) };
+    CHECK_THROWS_AS(t.query(q6, 4), TooManyKeys);
+    CHECK(t.query(q6, 4, QUERY_SUPERSET) == 5);
+
+    KeyValue q7[] = { KeyValue("Grade", "two"), KeyValue("Subject", "Art"), KeyValue("Score", 50) };
+    CHECK_THROWS_AS(t.query(q7, 3), ValueTypeError);
+
+    KeyValue q8[] = { KeyValue("Grades", 2), KeyValue("Subject", "Art"), KeyValue("Score", 50) };
+    CHECK_THROWS_AS(t.query(q8, 3), TooFewKeys);
+}
+
+TEST_CASE("Table Retrieve")
+{
+    DemoTable t;
+    KeyValue data[] = { KeyValue("Class", ""), KeyValue("Average", 0.0) };
+    t.retrieve(4, data, 2);
+    CHECK(std::string(data[0].val.s) == "B");
+    CHECK(data[1].type == NUMBER);
+    CHECK(data[1].val.n == Number(80));
+}
+
+TEST_CASE("Table Tokenize")
+{
+    const std::string pad(70, 'x');
+    const std::string s = "A.MH  =  B#  C\n"
+        "'" + pad + " = " + pad + "'  =  a&b\x01c  \"q'" + pad + "\"\r\n"
+        "\n"
+        "  " + pad + "\t=\t`` !$!";
+    const DemoTable t(s.c_str());
+    REQUIRE(t.rows() == 3);
+    REQUIRE(t.cols() == 3);
+    CHECK(std::string(t.cell(0, 1)) == "B#");
+    CHECK(std::string(t.cell(1, 0)) == pad + " = " + pad);
+    CHECK(std::string(t.cell(1, 1)) == "a&b\x01c");
+    CHECK(std::string(t.cell(1, 2)) == "q'" + pad);
+    CHECK(std::string(t.cell(2, 0)) == pad);
+    CHECK(std::string(t.cell(2, 1)) == "");
+    CHECK(std::string(t.cell(2, 2)) == "$");
+
+    CHECK_THROWS_WITH(DemoTable(("A.MH = B\n" + pad + " = 'x\n").c_str()), "Table has non-enclosed quote ' at row 1");
+    CHECK_THROWS_WITH(DemoTable(("A.MH = B\n\n" + pad + " x = y\n").c_str()), "Table has 1 criteria but 2 at row 1");
+    CHECK_THROWS_WITH(DemoTable(("A.MH = B\n" + pad + " = y z").c_str()), "Table has 2 columns but 3 at row 1");
+    CHECK_THROWS_WITH(DemoTable(" = y\n"), "Table has no criteria at row 0");
+    CHECK_THROWS_WITH(DemoTable("A.MH = B\nx =\n"), "Table has no data at row 1");
+}
+
+TEST_CASE("Table Load")
+{
+    const char path[] = "test_table_load.ini";
+    const std::string text = std::string(demo) + "  3  'Math Art'  0  inf  =  \"D D\"  0";
+
+    // Terminated in place in the mapping if there is room after the last cell, else copied.
+    for (int n = 0; n < 2; ++n)
+    {
+        const std::string s = n ? text + '\n' : text;
+        FILE* f = std::fopen(path, "wb");
+        REQUIRE(f);
+        std::fwrite(s.data(), 1, s.size(), f);
+        std::fclose(f);
+
+        Table t;
+        t.load(path);
+        f = std::fopen(path, "rb");
+        REQUIRE(f);
+        std::string file(s.size() + 1, '\0');
+        file.resize(std::fread(&file[0], 1, file.size(), f));
+        std::fclose(f);
+        CHECK(file == s);
+        std::remove(path);
+
+        INFO("newline " << n);
+        const DemoTable d(s.c_str());
+        REQUIRE(t.rows() == 7);
+        REQUIRE(t.cols() == d.cols());
+        CHECK(t.criteria() == d.criteria());
+        for (int i = 0; i < t.rows(); ++i)
+            for (int j = 0; j < t.cols(); ++j)
+                CHECK(std::string(t.cell(i, j)) == d.cell(i, j));
+        CHECK(std::string(t.cell(6, 1)) == "Math Art");
+        CHECK(std::string(t.cell(6, 4)) == "D D");
+
+        KeyValue q[] = { KeyValue("Grade", 2), KeyValue("Subject", "Math"), KeyValue("Score", 80) };
+        CHECK(t.query(q, 3) == 4);
+
+        CHECK_THROWS_AS(t.load(path), std::runtime_error);
+    }
+}
+
+namespace
+{
+    /// Linear scan with Criteria::distance, the reference of Table::query.
+    int Reference(const Table& t, const KeyValue kvs[], std::size_t num)
+    {
+        int min_i = 0;
+        double min_d = (Criteria::max)();
+        for (int i = 1; i < t.rows(); ++i)
+        {
+            double sum = 0;
+            for (int j = 0; j < t.criteria(); ++j)
+            {
+                Criteria c(t.cell(0, j), t.cell(i, j));
+                for (std::size_t k = 0; k < num; ++k)
+                {
+                    double d = c.distance(kvs[k]);
+                    if (d < 0) continue;
+                    sum += d;
+                    break;
+                }
+            }
+            if (sum < min_d)
+            {
+                min_d = sum;
+                min_i = i;
+            }
+        }
+        return min_i;
+    }
+
+    std::string RandomNumber()
+    {
+        switch (std::rand() % 16)
+        {
+        case 0: return "inf";
+        case 1: return "-inf";
+        default: return std::to_string(std::rand() % 40 - 20) + (std::rand() % 2 ? ".5" : "");
+        }
+    }
+
+    std::string RandomPattern(int alternatives)
+    {
+        const char* const alts[] = { "a", "B", "abc", "cc", "ab*", "*c", "?b", "*", "a*c" };
+        std::string s = alts[std::rand() % alternatives];
+        if (std::rand() % 2) s = s + '|' + alts[std::rand() % alternatives];
+        if (std::rand() % 8 == 0) s = alts[std::rand() % 9];
+        return s;
+    }
+
+    /// Random table of rows with EQ, range, MH and optionally AE criteria, std::rand seeded by seed.
+    std::string RandomTable(unsigned seed, int rows, bool withAE)
+    {
+        std::srand(seed);
+        std::string s = withAE ? "A.EQ B.GE B.LT C.MH D.AE = Row\n" : "A.EQ B.GE B.LT C.MH = Row\n";
+        for (int i = 1; i <= rows; ++i)
+        {
+            const int lo = std::rand() % 100;
+            s += std::to_string(std::rand() % 10) + ' ' + std::to_string(lo) + ' ' + std::to_string(lo + std::rand() % 50) +
+                 ' ' + RandomPattern(9);
+            if (withAE) s += ' ' + std::to_string(std::rand() % 1000);
+            s += " = " + std::to_string(i) + '\n';
+        }
+        return s;
+    }
+}
+
+TEST_CASE("Table Query Random")
+{
+    std::srand(20181015);
+    const char* const header[] = { "A.EQ", "B.GE", "B.LT", "C.GT", "C.LE", "D.LT", "E.GE", "F.AE", "G.MH" };
+    const char* const keys[] = { "A", "B", "B", "C", "C", "D", "E", "F", "G" };
+    const char* const values[] = { "a", "ab", "abc", "cc", "bb", "c", "B", "x" };
+
+    for (int n = 0; n < 12; ++n)
+    {
+        const bool literal = n % 2 == 1;
+        std::string s;
+        for (int j = 0; j < 9; ++j) s = s + header[j] + ' ';
+        s += "= Row\n";
+        const int rows = 1 + std::rand() % (literal ? 4000 : 600);
+        for (int i = 1; i <= rows; ++i)
+        {
+            for (int j = 0; j < 8; ++j) s += RandomNumber() + ' ';
+            s += RandomPattern(literal ? 4 : 9) + " = " + std::to_string(i) + '\n';
+        }
+        DemoTable t(s.c_str());
+
+        for (int m = 0; m < 200; ++m)
+        {
+            std::vector<KeyValue> kvs;
+            for (int j = 0; j < 9; ++j)
+            {
+                if (j == 2 || j == 4 || std::rand() % 4 == 0) continue;
+                if (j == 8) kvs.push_back(KeyValue(keys[j], values[std::rand() % 8]));
+                else kvs.push_back(KeyValue(keys[j], Number(RandomNumber().c_str())));
+            }
+            if (kvs.empty()) continue;
+            INFO("table " << n << " query " << m);
+            CHECK(t.query(&kvs[0], kvs.size(), QUERY_SUBSET) == Reference(t, &kvs[0], kvs.size()));
+        }
+    }
+}
+
+TEST_CASE("Table Query EQ Index")
+{
+    // Few distinct values, so each is shared by many rows, and queried values that no row has.
+    std::srand(20181016);
+    const char* const values[] = { "-2", "0", "1", "1.5", "3", "inf", "-inf" };
+    const char* const queries[] = { "-2", "0", "1", "1.5", "3", "inf", "-inf", "2", "1.25" };
+    std::string s = "A.EQ B.EQ C.AE = Row\n";
+    for (int i = 1; i <= 3000; ++i)
+    {
+        s += std::string(values[std::rand() % 7]) + ' ' + values[std::rand() % 3] + ' ';
+        s += std::to_string(std::rand() % 100) + " = " + std::to_string(i) + '\n';
+    }
+    DemoTable t(s.c_str());
+
+    for (int m = 0; m < 300; ++m)
+    {
+        KeyValue kvs[] = {
+            KeyValue("A", Number(queries[std::rand() % 9])),
+            KeyValue("B", Number(queries[std::rand() % 3])),
+            KeyValue("C", std::rand() % 100),
+        };
+        const std::size_t num = m % 2 ? 3 : 1;
+        INFO("query " << m);
+        CHECK(t.query(kvs, num, QUERY_SUBSET) == Reference(t, kvs, num));
+    }
+}
+
+TEST_CASE("Table Snapshot")
+{
+    std::srand(20251015);
+    const char path[] = "test_table_snapshot.qmx";
+    const char* const keys[] = { "A", "B", "C", "D", "E", "F", "G" };
+    const char* const values[] = { "a", "ab", "abc", "cc", "bb", "c", "B", "x" };
+    std::string s = "A.EQ B.GE B.LT C.GT D.LE E.AE F.MH G.MH = Row\n";
+    for (int i = 1; i <= 3000; ++i)
+    {
+        for (int j = 0; j < 6; ++j) s += RandomNumber() + ' ';
+        s += RandomPattern(9) + ' ' + RandomPattern(4) + " = '" + std::to_string(i) + " x'\n";
+    }
+    const DemoTable t(s.c_str());
+    t.save(path);
+
+    Table u;
+    u.loadCompiled(path);
+    REQUIRE(u.rows() == t.rows());
+    REQUIRE(u.cols() == t.cols());
+    CHECK(u.criteria() == t.criteria());
+    for (int i = 0; i < t.rows(); ++i)
+        for (int j = 0; j < t.cols(); ++j)
+            CHECK(std::string(u.cell(i, j)) == t.cell(i, j));
+
+    for (int m = 0; m < 500; ++m)
+    {
+        std::vector<KeyValue> kvs;
+        for (int j = 0; j < 7; ++j)
+        {
+            if (std::rand() % 4 == 0) continue;
+            if (j >= 5) kvs.push_back(KeyValue(keys[j], values[std::rand() % 8]));
+            else kvs.push_back(KeyValue(keys[j], Number(RandomNumber().c_str())));
+        }
+        if (kvs.empty()) continue;
+        INFO("query " << m);
+        CHECK(u.query(&kvs[0], kvs.size(), QUERY_SUBSET) == t.query(&kvs[0], kvs.size(), QUERY_SUBSET));
+    }
+
+    std::vector<char> image;
+    {
+        FILE* f = std::fopen(path, "rb");
+        REQUIRE(f);
+        for (int c; (c = std::fgetc(f)) != EOF; ) image.push_back((char)c);
+        std::fclose(f);
+    }
+    const auto rewrite = [&](const std::vector<char>& bytes)
+    {
+        FILE* f = std::fopen(path, "wb");
+        std::fwrite(bytes.data(), 1, bytes.size(), f);
+        std::fclose(f);
+    };
+
+    std::vector<char> bad = image;
+    bad[bad.size() / 2] ^= 1;
+    rewrite(bad);
+    CHECK_THROWS_WITH(u.loadCompiled(path), "Table snapshot is corrupted");
+    CHECK(u.rows() == t.rows()); // kept on a bad snapshot
+
+    bad.assign(image.begin(), image.end() - 8);
+    rewrite(bad);
+    CHECK_THROWS_WITH(u.loadCompiled(path), "Table snapshot is corrupted");
+
+    rewrite(std::vector<char>(s.begin(), s.end()));
+    CHECK_THROWS_WITH(u.loadCompiled(path), "Table snapshot has no QMEX signature");
+    std::remove(path);
+    CHECK_THROWS_AS(u.loadCompiled(path), std::runtime_error);
+}
+
+namespace
+{
+    /// Check u has the cells of t and answers random queries as t.
+    void CheckSame(const Table& u, const Table& t)
+    {
+        const char* const keys[] = { "A", "B", "C", "D" };
+        const char* const values[] = { "a", "ab", "abc", "cc", "bb", "c", "B", "x" };
+        REQUIRE(u.rows() == t.rows());
+        REQUIRE(u.cols() == t.cols());
+        REQUIRE(u.criteria() == t.criteria());
+        for (int i = 0; i < t.rows(); ++i)
+            for (int j = 0; j < t.cols(); ++j)
+                REQUIRE(std::string(u.cell(i, j)) == t.cell(i, j));
+        for (int m = 0; m < 300; ++m)
+        {
+            std::vector<KeyValue> kvs;
+            for (int j = 0; j < 4; ++j)
+            {
+                if (std::rand() % 4 == 0) continue;
+                if (j == 2) kvs.push_back(KeyValue(keys[j], values[std::rand() % 8]));
+                else kvs.push_back(KeyValue(keys[j], Number(RandomNumber().c_str())));
+            }
+            if (kvs.empty()) continue;
+            INFO("query " << m);
+            CHECK(u.query(&kvs[0], kvs.size(), QUERY_SUBSET) == t.query(&kvs[0], kvs.size(), QUERY_SUBSET));
+        }
+    }
+
+    /// Check a reload kept, spliced and built the criteria columns given, decoding decoded cells.
+    void CheckStats(const ReloadStats& r, int kept, int spliced, int built, std::size_t decoded)
+    {
+        CHECK(r.kept == kept);
+        CHECK(r.spliced == spliced);
+        CHECK(r.built == built);
+        CHECK(r.decoded == decoded);
+    }
+
+    /// Insert line before body row i, or remove body row i if line is empty, in table text s.
+    std::string Splice(const std::string& s, int i, const std::string& line)
+    {
+        std::size_t b = 0;
+        for (int k = 0; k < i; ++k) b = s.find('\n', b) + 1;
+        return line.empty() ? s.substr(0, b) + s.substr(s.find('\n', b) + 1) : s.substr(0, b) + line + '\n' + s.substr(b);
+    }
+
+    /// Replace column j of body row i in table text s.
+    std::string Replace(const std::string& s, int i, int j, const std::string& cell)
+    {
+        std::size_t b = 0;
+        for (int k = 0; k < i; ++k) b = s.find('\n', b) + 1;
+        const std::size_t e = s.find('\n', b);
+        std::vector<std::string> cells;
+        for (std::size_t p = b; p < e; )
+        {
+            const std::size_t q = (std::min)(s.find(' ', p), e);
+            cells.push_back(s.substr(p, q - p));
+            p = q + 1;
+        }
+        cells[j < 5 ? j : j + 1] = cell;
+        std::string line;
+        for (std::size_t k = 0; k < cells.size(); ++k) line += (k ? " " : "") + cells[k];
+        return s.substr(0, b) + line + s.substr(e);
+    }
+}
+
+TEST_CASE("Table Reload")
+{
+    std::string s = RandomTable(20250315, 2000, true);
+    std::vector<char> buf(s.c_str(), s.c_str() + s.size() + 1);
+    Table t;
+    t.parse(&buf[0], buf.size());
+
+    const auto reload = [&](const std::string& text)
+    {
+        std::vector<char> next(text.c_str(), text.c_str() + text.size() + 1);
+        const ReloadStats r = t.reload(&next[0], next.size());
+        buf.swap(next); // the previous buffer is released
+        s = text;
+        const DemoTable d(s.c_str());
+        CheckSame(t, d);
+        return r;
+    };
+
+    SECTION("changed cells")
+    {
+        CheckStats(reload(Replace(s, 7, 3, "zz*|a")), 4, 1, 0, 1);  // MH column only
+        CheckStats(reload(Replace(s, 1999, 1, "-3")), 4, 1, 0, 1); // range lower bound only
+        CheckStats(reload(Replace(Replace(s, 3, 0, "11"), 9, 5, "new")), 4, 1, 0, 1); // EQ and data columns
+        CheckStats(reload(s), 5, 0, 0, 0);                         // nothing
+    }
+
+    SECTION("changed rows")
+    {
+        // Every column has a cell added or removed, only the cells of added rows are decoded.
+        // The cells of row are unlike any random one, so the unchanged rows are aligned exactly.
+        const std::string row = "99 999 999 zz|a* 1000 = new";
+        CheckStats(reload(s + row + '\n'), 0, 5, 0, 5);             // appended
+        CheckStats(reload(Splice(s, 2001, "")), 0, 5, 0, 0);       // removed again
+        CheckStats(reload(Splice(s, 1000, row)), 0, 5, 0, 5);      // inserted
+        CheckStats(reload(Splice(Splice(s, 1000, ""), 1000, "")), 0, 5, 0, 0); // two removed
+        CheckStats(reload(Splice(Splice(s, 10, row), 1500, row)), 0, 5, 0, 5 * 1491); // rows between decoded
+        CheckStats(reload("A.EQ B.GE B.LT C.MH D.AE = Row Extra\n1 2 3 x 4 = 5 6\n"), 0, 0, 5, 5);
+    }
+
+    SECTION("changed shape")
+    {
+        CHECK(reload(RandomTable(1, 1500, true)).kept == 0);
+        CHECK(reload(RandomTable(2, 2500, true)).kept == 0);
+        CheckStats(reload("A.EQ B.GE B.LT C.MH D.AE = Row Extra\n1 2 3 x 4 = 5 6\n"), 0, 0, 5, 5);
+        CheckStats(reload(RandomTable(3, 100, true)), 0, 0, 5, 500);
+    }
+
+    SECTION("bad text")
+    {
+        std::string bad = Replace(s, 5, 0, "x");
+        std::vector<char> next(bad.c_str(), bad.c_str() + bad.size() + 1);
+        CHECK_THROWS_AS(t.reload(&next[0], next.size()), TableFormatError);
+        bad = s + "1 2 3\n";
+        next.assign(bad.c_str(), bad.c_str() + bad.size() + 1);
+        CHECK_THROWS_AS(t.reload(&next[0], next.size()), TableFormatError);
+        const DemoTable d(s.c_str());
+        CheckSame(t, d);
+    }
+
+    SECTION("snapshot")
+    {
+        const char path[] = "test_table_reload.qmx";
+        t.save(path);
+        t.loadCompiled(path);
+        std::remove(path);
+        CheckStats(reload(Replace(s, 100, 3, "q?")), 4, 1, 0, 1);
+        CheckStats(reload(Replace(s, 100, 0, "55")), 4, 1, 0, 1);
+        CheckStats(reload(Splice(s, 100, "")), 0, 5, 0, 0);        // cells copied out of the snapshot
+    }
+}
+
+namespace
+{
+    /// Parse s with threads, the cells joined by '|' or the error message.
+    std::string ParseWith(const std::string& s, unsigned threads)
+    {
+        std::vector<char> buf(s.c_str(), s.c_str() + s.size() + 1);
+        Table t;
+        try
+        {
+            t.parse(&buf[0], buf.size(), ParseOptions(threads));
+        }
+        catch (TableFormatError& e)
+        {
+            return e.what();
+        }
+        std::string cells = std::to_string(t.rows()) + 'x' + std::to_string(t.cols()) + 'x' + std::to_string(t.criteria());
+        for (int i = 0; i < t.rows(); ++i)
+            for (int j = 0; j < t.cols(); ++j)
+                cells += std::string("|") + t.cell(i, j);
+        return cells;
+    }
+}
+
+TEST_CASE("Table Parse Parallel")
+{
+    std::srand(20250101);
+    std::vector<std::string> lines(1, "A.EQ B.MH C.GE = D E\n");
+    for (int i = 1; i <= 40000; ++i)
+    {
+        std::string line = std::to_string(std::rand() % 10) + " '" + RandomPattern(9) + "' " + RandomNumber() +
+                           " = d" + std::to_string(i) + " \"e " + std::to_string(i) + "\"\n";
+        if (std::rand() % 16 == 0) line += std::rand() % 2 ? "\r\n" : "  \t\n";
+        lines.push_back(line);
+    }
+
+    std::string s;
+    for (std::size_t i = 0; i < lines.size(); ++i) s += lines[i];
+    REQUIRE(s.size() > (1 << 16) * 8);
+    const std::string serial = ParseWith(s, 1);
+    CHECK(serial.compare(0, 10, "40001x5x3|") == 0);
+    CHECK(ParseWith(s, 2) == serial);
+    CHECK(ParseWith(s, 8) == serial);
+    CHECK(ParseWith(s, 0) == serial);
+
+    const char* const errors[] = { "1 x = 1 2 3\n", "1 x 1 'y = 2\n", "1 x = 1\n", "= 1 2\n", "1 x 1 = \n" };
+    for (std::size_t k = 0; k < 20; ++k)
+    {
+        std::vector<std::string> bad = lines;
+        const std::size_t at = 1 + std::rand() % (lines.size() - 1);
+        bad[at] = errors[k % 5];
+        if (k % 4 == 0) bad[(at + 7919) % (lines.size() - 1) + 1] = errors[(k + 1) % 5];
+        s.clear();
+        for (std::size_t i = 0; i < bad.size(); ++i) s += bad[i];
+        const std::string message = ParseWith(s, 1);
+        CHECK(message.compare(0, 6, "Table ") == 0);
+        CHECK(ParseWith(s, 8) == message);
+    }
+
+    CHECK(ParseWith(std::string(1 << 20, '\n'), 8) == "Table is empty");
+}
+
+TEST_CASE("Table Query Batch")
+{
+    const std::string s = RandomTable(19491001, 2000, true);
+    const DemoTable t(s.c_str());
+
+    const char* const values[] = { "a", "ab", "abc", "cc", "bb", "c", "B", "x" };
+    std::vector<std::vector<KeyValue> > kvs(300);
+    std::vector<const KeyValue*> queries;
+    std::vector<std::size_t> nums;
+    for (std::size_t m = 0; m < kvs.size(); ++m)
+    {
+        if (std::rand() % 2) kvs[m].push_back(KeyValue("A", std::rand() % 10));
+        if (std::rand() % 2) kvs[m].push_back(KeyValue("B", std::rand() % 150));
+        if (std::rand() % 2) kvs[m].push_back(KeyValue("C", values[std::rand() % 8]));
+        kvs[m].push_back(KeyValue("D", std::rand() % 1000));
+        queries.push_back(&kvs[m][0]);
+        nums.push_back(kvs[m].size());
+    }
+
+    std::vector<int> rows(kvs.size(), -1);
+    t.queryBatch(&queries[0], &nums[0], kvs.size(), &rows[0], QUERY_SUBSET);
+    for (std::size_t m = 0; m < kvs.size(); ++m)
+        CHECK(rows[m] == t.query(queries[m], nums[m], QUERY_SUBSET));
+
+    KeyValue bad[] = { KeyValue("A", 1) };
+    queries[7] = bad;
+    nums[7] = 1;
+    CHECK_THROWS_AS(t.queryBatch(&queries[0], &nums[0], kvs.size(), &rows[0]), TooFewKeys);
+}
+
+TEST_CASE("Table Query Concurrently")
+{
+    const std::string s = RandomTable(20250101, 3000, false);
+    const DemoTable t(s.c_str());
+
+    const char* const values[] = { "a", "ab", "abc", "cc", "bb", "c", "B", "x" };
+    std::vector<std::vector<KeyValue> > queries;
+    std::vector<int> expected;
+    for (int m = 0; m < 500; ++m)
+    {
+        std::vector<KeyValue> kvs;
+        kvs.push_back(KeyValue("A", std::rand() % 10));
+        kvs.push_back(KeyValue("B", std::rand() % 150));
+        kvs.push_back(KeyValue("C", values[std::rand() % 8]));
+        queries.push_back(kvs);
+        expected.push_back(t.query(&kvs[0], kvs.size()));
+    }
+
+    std::atomic<int> mismatches(0);
+    std::vector<std::thread> threads;
+    for (int n = 0; n < 8; ++n)
+    {
+        threads.push_back(std::thread([&]() {
+            for (int k = 0; k < 20; ++k)
+                for (std::size_t m = 0; m < queries.size(); ++m)
+                    if (t.query(&queries[m][0], queries[m].size()) != expected[m]) ++mismatches;
+        }));
+    }
+    for (std::size_t n = 0; n < threads.size(); ++n)
+        threads[n].join();
+    CHECK(mismatches == 0);
+}
+
+TEST_CASE("Executor")
+{
+    const std::string s = RandomTable(20100501, 20000, true);
+    const DemoTable t(s.c_str());
+    Executor executor(4);
+    CHECK(executor.threads() == 4);
+
+    const char* const values[] = { "a", "ab", "abc", "cc", "bb", "c", "B", "x" };
+    std::vector<std::vector<KeyValue> > kvs(1000);
+    std::vector<const KeyValue*> queries;
+    std::vector<std::size_t> nums;
+    for (std::size_t m = 0; m < kvs.size(); ++m)
+    {
+        if (std::rand() % 2) kvs[m].push_back(KeyValue("A", std::rand() % 10));
+        if (std::rand() % 2) kvs[m].push_back(KeyValue("B", std::rand() % 150));
+        if (std::rand() % 2) kvs[m].push_back(KeyValue("C", values[std::rand() % 8]));
+        kvs[m].push_back(KeyValue("D", std::rand() % 1000));
+        queries.push_back(&kvs[m][0]);
+        nums.push_back(kvs[m].size());
+    }
+
+    std::vector<int> rows(kvs.size(), -1);
+    executor.queryBatch(t, &queries[0], &nums[0], kvs.size(), &rows[0], QUERY_SUBSET);
+    for (std::size_t m = 0; m < kvs.size(); ++m)
+    {
+        const int row = t.query(queries[m], nums[m], QUERY_SUBSET);
+        CHECK(rows[m] == row);
+        if (m % 10 == 0) CHECK(executor.query(t, queries[m], nums[m], QUERY_SUBSET) == row);
+    }
+
+    CHECK_THROWS_AS(executor.queryBatch(t, &queries[0], &nums[0], kvs.size(), &rows[0]), TooFewKeys);
+    KeyValue bad[] = { KeyValue("A", 1), KeyValue("C", 1) };
+    CHECK_THROWS_AS(executor.query(t, bad, 2, QUERY_SUBSET), ValueTypeError);
+}
+
+TEST_CASE("Table Handle")
+{
+    TableRegistry registry;
+    CHECK(registry.find("demo") == nullptr);
+    TableHandle& handle = registry.handle("demo");
+    CHECK(&registry.handle("demo") == &handle);
+    CHECK(registry.find("demo") == &handle);
+    CHECK(registry.find("dem") == nullptr);
+    CHECK(!handle.pin());
+    CHECK(handle.version() == 0);
+
+    // version n has n body rows, the last one matching A = n
+    std::vector<std::string> texts(1, "A.EQ = Row\n");
+    for (int n = 1; n <= 200; ++n)
+        texts.push_back(texts.back() + std::to_string(n) + " = " + std::to_string(n) + '\n');
+
+    handle.parse(texts[1].c_str(), texts[1].size());
+    CHECK(handle.version() == 1);
+    CHECK_THROWS_AS(handle.parse("A.EQ B = Row\n1 = 1\n", 18), TableFormatError);
+    CHECK(handle.version() == 1);
+    CHECK(handle.pin()->rows() == 2);
+
+    std::atomic<bool> done(false);
+    std::atomic<int> mismatches(0);
+    std::vector<std::thread> readers;
+    for (int k = 0; k < 4; ++k)
+    {
+        readers.push_back(std::thread([&] {
+            for (int last = 1; !done; )
+            {
+                TableHandle::Pin t = registry.find("demo")->pin();
+                const int n = t->rows() - 1;
+                KeyValue kv("A", n);
+                if (n < last || t->query(&kv, 1) != n || std::atoi(t->cell(n, 1)) != n) ++mismatches;
+                last = n;
+            }
+        }));
+    }
+
+    for (int n = 2; n <= 200; ++n)
+        handle.parse(texts[n].c_str(), texts[n].size());
+    done = true;
+    for (std::size_t k = 0; k < readers.size(); ++k)
+        readers[k].join();
+    CHECK(mismatches == 0);
+    CHECK(handle.version() == 200);
+    CHECK(handle.pin()->rows() == 201);
+}
+
+TEST_CASE("Table Handle Pinned Publish")
+{
+    TableHandle handle;
+    handle.parse("A.EQ = Row\n1 = 1\n", 18);
+    TableHandle::Pin first = handle.pin();
+
+    // publishing once while pinned returns, from this thread too, and leaves the pinned version intact
+    handle.parse("A.EQ = Row\n2 = 2\n", 18);
+    CHECK(handle.version() == 2);
+    CHECK(std::string(first->cell(1, 0)) == "1");
+    CHECK(std::string(handle.pin()->cell(1, 0)) == "2");
+
+    // publishing again has to reuse the slot of the pinned version, so waits until it is released
+    std::atomic<bool> published(false);
+    std::thread writer([&] {
+        handle.parse("A.EQ = Row\n3 = 3\n", 18);
+        published = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    CHECK(!published);
+    CHECK(handle.version() == 2);
+    CHECK(std::string(first->cell(1, 0)) == "1");
+    {
+        TableHandle::Pin released(std::move(first));
+    }
+    writer.join();
+    CHECK(published);
+    CHECK(handle.version() == 3);
+    CHECK(std::string(handle.pin()->cell(1, 0)) == "3");
+}
+
+TEST_CASE("Lua State Pool")
+{
+    const DemoTable t;
+    LuaStatePool pool(t);
+    CHECK(pool.size() == 1);
+    {
+        LuaStatePool::Lease a = pool.lease();
+        LuaStatePool::Lease b = pool.lease();
+        CHECK(pool.size() == 2);
+    }
+    {
+        LuaStatePool::Lease a = pool.lease();
+        CHECK(pool.size() == 2);
+    }
+
+    std::atomic<int> mismatches(0);
+    std::vector<std::thread> threads;
+    for (int n = 0; n < 4; ++n)
+    {
+        threads.push_back(std::thread([&]() {
+            LuaStatePool::Lease lease = pool.lease();
+            for (int k = 0; k < 1000; ++k)
+            {
+                const int row = 1 + k % 5;
+                KeyValue data[] = { KeyValue("Class", ""), KeyValue("Average", 0.0) };
+                lease.retrieve(row, data, 2);
+                if (std::strcmp(data[0].val.s, t.cell(row, 4))) ++mismatches;
+                lease.verify(row, data, 2);
+            }
+        }));
+    }
+    for (std::size_t n = 0; n < threads.size(); ++n)
+        threads[n].join();
+    CHECK(mismatches == 0);
+    CHECK(pool.size() <= 4);
+}
+
+namespace
+{
+    /// Jit [] functions returning 7, counting the jits and the runs of the functions.
+    struct CountingJIT : LuaJIT
+    {
+        int calls;
+        int runs;
+
+        CountingJIT() : calls(0), runs(0) {}
+
+        static int seven(lua_State* L)
+        {
+            ++static_cast<CountingJIT*>(lua_touserdata(L, lua_upvalueindex(1)))->runs;
+            lua_pushinteger(L, 7);
+            return 1;
+        }
+
+        void jit(lua_State* L, int env, const char* name) override
+        {
+            ++calls;
+            lua_pushlightuserdata(L, this);
+            lua_pushcclosure(L, &seven, 1);
+            lua_setfield(L, env, name);
+        }
+    };
+}
+
+TEST_CASE("Table Precompile", "[lua]")
+{
+    const std::string s = "A.EQ = B C\n1 = {1+1} [Seven]\n2 = 3 x\n";
+    std::vector<char> buf(s.c_str(), s.c_str() + s.size() + 1);
+    CountingJIT jit;
+    Table t;
+    t.parse(&buf[0], buf.size(), ParseOptions(1, true), nullptr, &jit);
+    CHECK(jit.calls == 1); // resolved when parsed
+
+    KeyValue data[] = { KeyValue("B", 0.0), KeyValue("C", 0.0) };
+    t.retrieve(1, data, 2);
+    CHECK(data[0].val.n == Number(2));
+    CHECK(data[1].val.n == Number(7));
+    CHECK(jit.calls == 1);
+
+    SECTION("parse")
+    {
+        const std::string bad = "A.EQ = B C\n1 = {1+1} x\n2 = y {1+}\n";
+        std::vector<char> next(bad.c_str(), bad.c_str() + bad.size() + 1);
+        Table u;
+        CHECK_THROWS_AS(u.parse(&next[0], next.size(), ParseOptions(1, true)), TableFormatError);
+        CHECK_THROWS_WITH(u.parse(&next[0], next.size(), ParseOptions(1, true)), Catch::Contains("Table row:2, col:3[C]"));
+        CHECK_NOTHROW(u.parse(&next[0], next.size())); // compiled on first retrieve otherwise
+    }
+
+    SECTION("reload")
+    {
+        const std::string bad = "A.EQ = B C\n1 = {1+} [Seven]\n2 = 3 x\n";
+        std::vector<char> next(bad.c_str(), bad.c_str() + bad.size() + 1);
+        CHECK_THROWS_WITH(t.reload(&next[0], next.size(), ParseOptions(1, true)), Catch::Contains("Table row:1, col:2[B]"));
+        CHECK(std::string(t.cell(1, 1)) == "{1+1}"); // kept on a failed reload
+        t.retrieve(1, data, 2);
+        CHECK(data[0].val.n == Number(2));
+
+        const std::string good = "A.EQ = B C\n1 = {1+1} [Seven]\n2 = {2+2} [Eight]\n";
+        next.assign(good.c_str(), good.c_str() + good.size() + 1);
+        t.reload(&next[0], next.size(), ParseOptions(1, true));
+        buf.swap(next);
+        CHECK(jit.calls == 2);
+        t.retrieve(2, data, 2);
+        CHECK(data[0].val.n == Number(4));
+        CHECK(data[1].val.n == Number(7));
+    }
+}
+
+TEST_CASE("Table Chunk Cache", "[lua]")
+{
+    const char path[] = "test_table_chunks.qmc";
+    DemoTable t("A.EQ = B C\n1 = {1+1} {2*3}\n2 = {1+1} x\n3 = {10} {2*3}\n");
+    t.saveChunks(path);
+
+    KeyValue data[] = { KeyValue("B", 0.0), KeyValue("C", 0.0) };
+    DemoTable u("A.EQ = B C\n1 = {1+1} {2*3}\n2 = {1+1} x\n3 = {10} {2*3}\n");
+    CHECK(u.loadChunks(path) == 5);
+    u.retrieve(1, data, 2);
+    CHECK(data[0].val.n == Number(2));
+    CHECK(data[1].val.n == Number(6));
+    u.retrieve(3, data, 2);
+    CHECK(data[0].val.n == Number(10));
+    CHECK(data[1].val.n == Number(6));
+
+    // Cells changed since saved are compiled from their text.
+    DemoTable v("A.EQ = B C\n1 = {1+2} {2*3}\n2 = {1+1} x\n3 = {11} {2*3}\n");
+    CHECK(v.loadChunks(path) == 3);
+    v.retrieve(1, data, 2);
+    CHECK(data[0].val.n == Number(3));
+    CHECK(data[1].val.n == Number(6));
+    v.retrieve(3, data, 2);
+    CHECK(data[0].val.n == Number(11));
+    std::remove(path);
+}
+
+TEST_CASE("Table Chunk Cache Format")
+{
+    const char path[] = "test_table_chunks_format.qmc";
+    DemoTable t; // no {} cells, so nothing is compiled
+    t.saveChunks(path);
+    CHECK(t.loadChunks(path) == 0);
+
+    std::vector<char> image;
+    {
+        FILE* f = std::fopen(path, "rb");
+        REQUIRE(f);
+        for (int c; (c = std::fgetc(f)) != EOF; ) image.push_back((char)c);
+        std::fclose(f);
+    }
+    const auto rewrite = [&](const std::vector<char>& bytes)
+    {
+        FILE* f = std::fopen(path, "wb");
+        std::fwrite(bytes.data(), 1, bytes.size(), f);
+        std::fclose(f);
+    };
+
+    std::vector<char> bad = image;
+    bad[0] ^= 1;
+    rewrite(bad);
+    CHECK_THROWS_WITH(t.loadChunks(path), "Table chunk cache has no QMEX signature");
+
+    bad.assign(image.begin(), image.begin() + 8);
+    rewrite(bad);
+    CHECK_THROWS_WITH(t.loadChunks(path), "Table chunk cache is corrupted");
+
+    bad = image;
+    bad.push_back('\0');
+    rewrite(bad);
+    CHECK_THROWS_WITH(t.loadChunks(path), "Table chunk cache is corrupted");
+    std::remove(path);
+}
+
+TEST_CASE("Table Memoize", "[lua]")
+{
+    DemoTable t("A.EQ = D E C\n1 = {math.random()} {_ENV.Rate} {Rate*2}\n");
+    t.memoize(true);
+    KeyValue rate("Rate", 3);
+    t.setenv(&rate, 1);
+
+    // D and E are evaluated before C by each retrieve, but never memoized.
+    KeyValue data[] = { KeyValue("D", 0.0), KeyValue("E", 0.0), KeyValue("C", 0.0) };
+    t.retrieve(1, data, 3);
+    const Number random = data[0].val.n;
+    CHECK(data[2].val.n == Number(6));
+    CHECK(t.memoStats().hits == 0);
+    CHECK(t.memoStats().misses == 1);
+
+    t.retrieve(1, data, 3);
+    CHECK(data[2].val.n == Number(6));
+    CHECK(t.memoStats().hits == 1);
+    CHECK(t.memoStats().misses == 1);
+
+    rate = KeyValue("Rate", 4);
+    t.setenv(&rate, 1);
+    t.retrieve(1, data, 3);
+    CHECK(data[1].val.n == Number(4));
+    CHECK(data[2].val.n == Number(8));
+    CHECK(t.memoStats().hits == 1);
+    CHECK(t.memoStats().misses == 2);
+
+    bool changed = false;
+    for (int k = 0; k < 10 && !changed; ++k)
+    {
+        t.retrieve(1, data, 3);
+        changed = data[0].val.n != random;
+    }
+    CHECK(changed);
+    CHECK(t.memoStats().misses == 2);
+
+    // Flag reads as a boolean, so F is evaluated each time, while T calls the C function tonumber.
+    lua_State* L = luaL_newstate();
+    luaL_openlibs(L);
+    lua_pushboolean(L, 1);
+    lua_setglobal(L, "Flag");
+    {
+        const std::string s = "A.EQ = F T\n1 = {Flag and Rate or 0} {tonumber(Rate)}\n";
+        std::vector<char> buf(s.c_str(), s.c_str() + s.size() + 1);
+        Table u;
+        u.parse(&buf[0], buf.size(), L);
+        u.memoize(true);
+        u.setenv(&rate, 1);
+        KeyValue kvs[] = { KeyValue("F", 0.0), KeyValue("T", 0.0) };
+        u.retrieve(1, kvs, 2);
+        u.retrieve(1, kvs, 2);
+        CHECK(kvs[0].val.n == Number(4));
+        CHECK(kvs[1].val.n == Number(4));
+        CHECK(u.memoStats().hits == 1);
+        CHECK(u.memoStats().misses == 3);
+    }
+    lua_close(L);
+}
+
+TEST_CASE("Table Row Plan", "[lua]")
+{
+    const std::string s = "A.EQ = B C D E\n1 = 5 [Seven] {B+C} {D*2}\n";
+    std::vector<char> buf(s.c_str(), s.c_str() + s.size() + 1);
+    CountingJIT jit;
+    Table t;
+    t.parse(&buf[0], buf.size(), nullptr, &jit);
+
+    // Each lua column runs once per retrieve, later cells see the plain and lua columns before them.
+    KeyValue data[] = { KeyValue("E", 0.0), KeyValue("D", 0.0), KeyValue("C", 0.0), KeyValue("B", "") };
+    t.retrieve(1, data, 4);
+    CHECK(jit.runs == 1);
+    CHECK(data[0].val.n == Number(24));
+    CHECK(data[1].val.n == Number(12));
+    CHECK(data[2].val.n == Number(7));
+    CHECK(std::string(data[3].val.s) == "5");
+
+    t.retrieve(1, data, 4);
+    CHECK(jit.runs == 2);
+    CHECK(jit.calls == 1);
+
+    KeyValue last("E", 0.0);
+    t.retrieve(1, &last, 1);
+    CHECK(jit.runs == 3);
+    CHECK(last.val.n == Number(24));
+}